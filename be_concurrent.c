@@ -0,0 +1,501 @@
+/*
+ * be_concurrent.c -- word table in DRAM shared by many threads
+ */
+#include <err.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libfreq.h"
+#include "epoch.h"
+#include "lockword.h"
+
+/* buckets a table starts with, it doubles whenever it holds more entries */
+#define INITIAL_BITS 14
+
+/*
+ * the count of an entry that was pruned and is on its way out, and of
+ * one that has saturated; under its bucket's lock an entry still in the
+ * chain is never a pruned one, so that is where the two are told apart
+ */
+#define DEAD UINT64_MAX
+
+/* the entries of a bucket that grow() has moved to the next array */
+#define MOVED ((struct entry *)1)
+
+/*
+ * entries in a bucket are a linked list of struct entry; an entry fills
+ * a cache line, so bumping one count never steals the line of another.
+ * Readers walk chains without locks, inside an epoch section, so an
+ * entry that is unlinked by pruning or moved by growing the table is
+ * retired rather than freed, and counts are bumped atomically.
+ */
+struct entry {
+	struct entry *next;
+	const char *word;
+	uint64_t hash;			/* freq_hash64(word) */
+	uint64_t count;			/* DEAD once pruned or saturated */
+} __attribute__((aligned(FREQ_CACHELINE)));
+
+/*
+ * each bucket contains a pointer to the linked list of entries, a lock
+ * word serializing writers and a sequence word for readers; four buckets
+ * share a cache line, but only writers ever store to it
+ */
+struct bucket {
+	uint32_t lock;			/* serializes changes to entries */
+	uint32_t seq;			/* odd while entries is changing */
+	struct entry *entries;
+};
+
+/*
+ * an array of 1 << bits buckets, replaced by one twice as big to grow;
+ * bucket i of an array becomes buckets 2i and 2i + 1 of the next
+ */
+struct barray {
+	unsigned bits;
+	struct barray *next;		/* the array growing moves to */
+	struct bucket B[] __attribute__((aligned(FREQ_CACHELINE)));
+};
+
+struct ctable {
+	struct freq_table base;
+	struct barray *buckets;		/* the current array */
+	uint32_t resize;		/* held while growing or pruning */
+	uint64_t nentries		/* entries in the table */
+		__attribute__((aligned(FREQ_CACHELINE)));
+	uint64_t word_bytes;		/* for freq_stats, as nentries */
+	uint64_t overhead_bytes;
+};
+
+/* bucket of array a a hash belongs in, taken from the hash's top bits */
+static inline struct bucket *bucket(struct barray *a, uint64_t h)
+{
+	return &a->B[(h * 0x9e3779b97f4a7c15ULL) >> (64 - a->bits)];
+}
+
+static struct barray *barray_create(unsigned bits)
+{
+	struct barray *a;
+	size_t size = sizeof(*a) + (sizeof(a->B[0]) << bits);
+
+	if ((errno = posix_memalign((void **)&a, FREQ_CACHELINE, size)) != 0)
+		err(1, "posix_memalign");
+	memset(a, 0, size);
+
+	a->bits = bits;
+	return a;
+}
+
+/* count an entry into the table's stats, or with dir -1 out of them */
+static void conc_account(struct ctable *ct, struct entry *ep, int dir)
+{
+	size_t len = strlen(ep->word) + 1;
+	uint64_t d = dir;
+
+	__atomic_add_fetch(&ct->nentries, d, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&ct->word_bytes, d * len, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&ct->overhead_bytes, d *
+			(freq_malloc_overhead(ep, sizeof(*ep)) +
+			freq_malloc_overhead((char *)ep->word, len)),
+			__ATOMIC_RELAXED);
+}
+
+/*
+ * entry for word, NULL if there is none; *ap is the array it was looked
+ * up in.  Takes no lock, needs an epoch section
+ */
+static struct entry *lookup(struct ctable *ct, uint64_t h, const char *word,
+		struct barray **ap)
+{
+	struct barray *a = __atomic_load_n(&ct->buckets, __ATOMIC_ACQUIRE);
+	struct bucket *bp;
+	struct entry *ep;
+	uint32_t s;
+
+	/*
+	 * an entry that matches is the word's even if the chain changed
+	 * under us, only a miss needs checking against the sequence word;
+	 * growing keeps a bucket's odd only while it moves that bucket
+	 */
+	for (;;) {
+		bp = bucket(a, h);
+		s = freq_seq_begin(&bp->seq);
+		ep = __atomic_load_n(&bp->entries, __ATOMIC_ACQUIRE);
+		if (ep == MOVED) {
+			a = __atomic_load_n(&a->next, __ATOMIC_ACQUIRE);
+			continue;
+		}
+
+		*ap = a;
+		for (; ep != NULL; ep = __atomic_load_n(&ep->next,
+				__ATOMIC_ACQUIRE))
+			if (ep->hash == h && strcmp(word, ep->word) == 0)
+				return ep;
+
+		if (!freq_seq_retry(&bp->seq, s))
+			return NULL;
+	}
+}
+
+/*
+ * add n to an entry's count, saturating; 0 if the count was DEAD, which
+ * only the entry's bucket lock can say is pruned or saturated
+ */
+static int bump(struct entry *ep, uint64_t n)
+{
+	uint64_t old = __atomic_load_n(&ep->count, __ATOMIC_RELAXED);
+
+	do {
+		if (old == DEAD)
+			return 0;
+	} while (!__atomic_compare_exchange_n(&ep->count, &old,
+			freq_sat_add(old, n), 1, __ATOMIC_RELAXED,
+			__ATOMIC_RELAXED));
+
+	return 1;
+}
+
+/*
+ * add word with count n to array a, unless it got there first; 0 if it
+ * has to be tried again, 2 if it made a new entry, 1 otherwise
+ */
+static int insert(struct ctable *ct, struct barray *a, uint64_t h,
+		const char *word, uint64_t n)
+{
+	struct bucket *bp = bucket(a, h);
+	struct entry *ep;
+	int ret = 1;
+
+	freq_lock(&bp->lock);
+
+	/* the bucket moved while we were waiting, the word belongs elsewhere */
+	if (bp->entries == MOVED) {
+		freq_unlock(&bp->lock);
+		return 0;
+	}
+
+	/*
+	 * another thread may have added the word since the lookup; pruning
+	 * holds this lock, so an entry found here is live, and one whose
+	 * bump fails has saturated
+	 */
+	for (ep = bp->entries; ep != NULL; ep = ep->next)
+		if (ep->hash == h && strcmp(word, ep->word) == 0) {
+			bump(ep, n);
+			goto out;
+		}
+
+	/* allocate new entry in table, on a line of its own */
+	if ((errno = posix_memalign((void **)&ep, FREQ_CACHELINE,
+			sizeof(*ep))) != 0)
+		err(1, "posix_memalign");
+	memset(ep, 0, sizeof(*ep));
+
+	if ((ep->word = strdup(word)) == NULL)
+		err(1, "strdup");
+
+	ep->hash = h;
+	ep->count = n;
+
+	/* add it to the front of the linked list */
+	ep->next = bp->entries;
+	freq_seq_write_begin(&bp->seq);
+	__atomic_store_n(&bp->entries, ep, __ATOMIC_RELEASE);
+	freq_seq_write_end(&bp->seq);
+
+	conc_account(ct, ep, 1);
+	ret = 2;
+out:
+	freq_unlock(&bp->lock);
+	return ret;
+}
+
+/* add n to the count for a word; as insert(), needs an epoch section */
+static int add(struct ctable *ct, uint64_t h, const char *word, uint64_t n)
+{
+	struct barray *a;
+	struct entry *ep;
+
+	/* a bump that fails is sorted out under the bucket lock */
+	if ((ep = lookup(ct, h, word, &a)) != NULL && bump(ep, n))
+		return 1;
+
+	return insert(ct, a, h, word, n);
+}
+
+/*
+ * double the bucket array if the table holds more entries than it has
+ * buckets, unless another thread is already at it; outside any section
+ */
+static void grow(struct ctable *ct)
+{
+	struct barray *a, *na;
+	size_t nb;
+
+	if (!freq_trylock(&ct->resize))
+		return;
+
+	a = ct->buckets;
+	nb = (size_t)1 << a->bits;
+
+	if (__atomic_load_n(&ct->nentries, __ATOMIC_RELAXED) <= nb) {
+		freq_unlock(&ct->resize);
+		return;
+	}
+
+	na = barray_create(a->bits + 1);
+	__atomic_store_n(&a->next, na, __ATOMIC_RELEASE);
+
+	/*
+	 * move one bucket at a time, so only lookups and inserts of that
+	 * bucket wait: its entries go to the front of their new chains,
+	 * which nothing else can reach until the bucket is marked MOVED.
+	 * A reader still on the old chain may be led onto a new one, but
+	 * every entry moves once and only to in front of entries that
+	 * moved before it, so whatever it follows ends
+	 */
+	for (size_t i = 0; i < nb; i++) {
+		struct bucket *op = &a->B[i];
+		struct entry *ep, *next;
+
+		freq_lock(&op->lock);
+		freq_seq_write_begin(&op->seq);
+
+		for (ep = op->entries; ep != NULL; ep = next) {
+			struct bucket *bp = bucket(na, ep->hash);
+
+			next = ep->next;
+			__atomic_store_n(&ep->next, bp->entries,
+					__ATOMIC_RELEASE);
+			bp->entries = ep;
+		}
+
+		__atomic_store_n(&op->entries, MOVED, __ATOMIC_RELEASE);
+		freq_seq_write_end(&op->seq);
+		freq_unlock(&op->lock);
+	}
+
+	__atomic_store_n(&ct->buckets, na, __ATOMIC_RELEASE);
+
+	/* lookups and inserts that started on it may still be using it */
+	freq_epoch_retire(a, free);
+	freq_unlock(&ct->resize);
+}
+
+/* add n to the count for a word */
+static void conc_add(struct freq_table *t, const char *word, uint64_t n)
+{
+	struct ctable *ct = (struct ctable *)t;
+	uint64_t h = freq_hash64(word, strlen(word));
+	int r;
+
+	freq_epoch_enter();
+	while ((r = add(ct, h, word, n)) == 0)
+		;
+	freq_epoch_exit();
+
+	if (r == 2)
+		grow(ct);
+}
+
+/*
+ * prefetch for word i + d of a batch the first entry of its chain, and
+ * for word i + 2 * d its bucket
+ */
+static inline void prefetch(struct barray *a, const uint64_t *h, size_t n,
+		size_t i, size_t d)
+{
+	struct entry *ep;
+
+	if (i + 2 * d < n)
+		__builtin_prefetch(bucket(a, h[i + 2 * d]));
+	if (i + d < n && (ep = __atomic_load_n(&bucket(a, h[i + d])->entries,
+			__ATOMIC_RELAXED)) != NULL && ep != MOVED)
+		__builtin_prefetch(ep);
+}
+
+/*
+ * add the counts of a batch of words inside one epoch section, looking
+ * them up without locks and prefetching ahead; the batch comes grouped
+ * by freq_hash(), which says nothing about this table's buckets, so new
+ * words are inserted one at a time
+ */
+static void conc_count_batch(struct freq_table *t, const struct freq_bword *w,
+		size_t n)
+{
+	struct ctable *ct = (struct ctable *)t;
+	uint64_t h[FREQ_BATCH];
+	size_t d = freq_prefetch;
+	struct barray *a;
+	int r, grew = 0;
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		h[i] = freq_hash64(w[i].word, w[i].len);
+
+	freq_epoch_enter();
+
+	/* growing meanwhile only makes the prefetches less useful */
+	a = __atomic_load_n(&ct->buckets, __ATOMIC_ACQUIRE);
+	for (i = 0; d != 0 && i < 2 * d && i < n; i++)
+		__builtin_prefetch(bucket(a, h[i]));
+
+	for (i = 0; i < n; i++) {
+		if (d != 0)
+			prefetch(a, h, n, i, d);
+		while ((r = add(ct, h[i], w[i].word, w[i].n)) == 0)
+			;
+		grew |= r == 2;
+	}
+
+	freq_epoch_exit();
+
+	if (grew)
+		grow(ct);
+}
+
+/* bump the count for a word */
+static void conc_count(struct freq_table *t, const char *word)
+{
+	conc_add(t, word, 1);
+}
+
+static void free_entry(void *p)
+{
+	struct entry *ep = p;
+
+	free((char *)ep->word);
+	free(ep);
+}
+
+/*
+ * unlink and retire every entry counted fewer than min times; counting
+ * may go on meanwhile, a bump that loses the race to a pruned entry
+ * looks the word up again and starts it afresh
+ */
+static uint64_t conc_prune(struct freq_table *t, uint64_t min)
+{
+	struct ctable *ct = (struct ctable *)t;
+	struct barray *a;
+	uint64_t removed = 0;
+
+	/* keep the table from growing under us */
+	freq_lock(&ct->resize);
+	a = ct->buckets;
+
+	for (size_t i = 0; i < (size_t)1 << a->bits; i++) {
+		struct bucket *bp = &a->B[i];
+		struct entry **pp, *ep;
+
+		freq_lock(&bp->lock);
+
+		for (pp = &bp->entries; (ep = *pp) != NULL; ) {
+			uint64_t c = __atomic_load_n(&ep->count,
+					__ATOMIC_RELAXED);
+
+			while (c < min && !__atomic_compare_exchange_n(
+					&ep->count, &c, DEAD, 1,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				;
+
+			if (c >= min) {
+				pp = &ep->next;
+				continue;
+			}
+
+			freq_seq_write_begin(&bp->seq);
+			__atomic_store_n(pp, ep->next, __ATOMIC_RELEASE);
+			freq_seq_write_end(&bp->seq);
+
+			conc_account(ct, ep, -1);
+			freq_epoch_retire(ep, free_entry);
+			removed++;
+		}
+
+		freq_unlock(&bp->lock);
+	}
+
+	freq_unlock(&ct->resize);
+	return removed;
+}
+
+static uint64_t conc_size(struct freq_table *t)
+{
+	return __atomic_load_n(&((struct ctable *)t)->nentries,
+			__ATOMIC_RELAXED);
+}
+
+/* the bucket array may be being replaced, so its size is only a guess */
+static void conc_stats(struct freq_table *t, struct freq_stats *st)
+{
+	struct ctable *ct = (struct ctable *)t;
+	struct barray *a;
+
+	st->entries = __atomic_load_n(&ct->nentries, __ATOMIC_RELAXED);
+	st->entry_bytes = st->entries * sizeof(struct entry);
+	st->word_bytes = __atomic_load_n(&ct->word_bytes, __ATOMIC_RELAXED);
+	st->overhead_bytes = __atomic_load_n(&ct->overhead_bytes,
+			__ATOMIC_RELAXED);
+
+	freq_epoch_enter();
+	a = __atomic_load_n(&ct->buckets, __ATOMIC_ACQUIRE);
+	st->bucket_bytes = sizeof(*a) + (sizeof(a->B[0]) << a->bits);
+	freq_epoch_exit();
+}
+
+/* call fn for every entry in the table, no counting may be in progress */
+static void conc_walk(struct freq_table *t, freq_walk_fn fn, void *arg)
+{
+	struct barray *a = ((struct ctable *)t)->buckets;
+	struct entry *ep;
+
+	for (size_t i = 0; i < (size_t)1 << a->bits; i++)
+		for (ep = a->B[i].entries; ep != NULL; ep = ep->next)
+			fn(ep->word, ep->count, arg);
+}
+
+/* free every entry, the table itself, and whatever it retired */
+static void conc_close(struct freq_table *t)
+{
+	struct barray *a = ((struct ctable *)t)->buckets;
+	struct entry *ep, *next;
+
+	for (size_t i = 0; i < (size_t)1 << a->bits; i++)
+		for (ep = a->B[i].entries; ep != NULL; ep = next) {
+			next = ep->next;
+			free_entry(ep);
+		}
+
+	free(a);
+	free(t);
+	freq_epoch_barrier();
+}
+
+static const struct freq_ops conc_ops = {
+	.name = "concurrent",
+	.count = conc_count,
+	.add = conc_add,
+	.count_batch = conc_count_batch,
+	.prune = conc_prune,
+	.size = conc_size,
+	.stats = conc_stats,
+	.walk = conc_walk,
+	.close = conc_close,
+};
+
+/* table in DRAM safe for concurrent count() calls */
+struct freq_table *freq_concurrent_create(void)
+{
+	struct ctable *ct;
+
+	if ((errno = posix_memalign((void **)&ct, FREQ_CACHELINE,
+			sizeof(*ct))) != 0)
+		err(1, "posix_memalign");
+	memset(ct, 0, sizeof(*ct));
+
+	ct->base.ops = &conc_ops;
+	ct->buckets = barray_create(INITIAL_BITS);
+	return &ct->base;
+}
@@ -0,0 +1,1167 @@
+/*
+ * be_pmem.c -- word table in a pmem pool
+ */
+#include <err.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <libpmemobj.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libfreq_pmem.h"
+#include "lockword.h"
+
+/* declare all the types used in the layout of our pmempool file */
+POBJ_LAYOUT_BEGIN(freq);
+POBJ_LAYOUT_ROOT(freq, struct root);
+POBJ_LAYOUT_TOID(freq, struct entry);
+POBJ_LAYOUT_TOID(freq, char);
+POBJ_LAYOUT_TOID(freq, struct bucket);
+POBJ_LAYOUT_TOID(freq, struct mergelog);
+POBJ_LAYOUT_END(freq);
+
+/*
+ * versions of the table layout, recorded in the root object; pools
+ * written before the layout was recorded read back as LAYOUT_INT_COUNT
+ */
+#define LAYOUT_INT_COUNT	0	/* count was a 32-bit int */
+#define LAYOUT_U64_COUNT	1	/* count is a uint64_t */
+#define LAYOUT_NO_MUTEX		2	/* entries have no PMEMmutex */
+#define LAYOUT_NO_RWLOCK	3	/* buckets have no PMEMrwlock */
+#define LAYOUT_CURRENT		LAYOUT_NO_RWLOCK
+
+/* root object definition */
+struct root {
+	TOID(struct bucket) h;	/* hash table for word frequencies */
+	uint64_t layout;	/* LAYOUT_* of the table h points to */
+	uint64_t migrated;	/* buckets converted to the next layout */
+	TOID(struct mergelog) merge;	/* see freq_pmem_merge() */
+	/* ... OIDs for other things we store in this pool go here... */
+};
+
+/*
+ * a merge from another pool into this one, while it is in progress; the
+ * buckets are split into nranges ranges merged in parallel, and each
+ * range's progress is kept here in the transaction that adds its counts
+ */
+struct mergelog {
+	uint64_t source;	/* pool_uuid_lo of the pool merged from */
+	uint64_t nranges;
+	uint64_t next[];	/* first bucket of each range not merged */
+};
+
+/*
+ * entries in a bucket are a linked list of struct entry; the lock for
+ * count is volatile, see entry_lock()
+ */
+struct entry {
+	TOID(struct entry) next;
+	TOID(char) word;
+	uint64_t count;
+};
+
+/* struct entry before LAYOUT_NO_MUTEX, only read to migrate it */
+struct entry_mutex {
+	TOID(struct entry) next;
+	TOID(char) word;
+	PMEMmutex mutex;		/* protected count */
+	uint64_t count;			/* an int in LAYOUT_INT_COUNT */
+};
+
+/*
+ * each bucket contains a pointer to the linked list of entries.  Only
+ * an insert writes it, with the index bucket's lock word held, so it
+ * needs no lock in pmem.
+ */
+struct bucket {
+	TOID(struct entry) entries;
+};
+
+/* struct bucket before LAYOUT_NO_RWLOCK, only read to migrate it */
+struct bucket_rwlock {
+	PMEMrwlock rwlock;		/* protected entries */
+	TOID(struct entry) entries;
+};
+
+/*
+ * the volatile index, a copy in DRAM of each bucket's words pointing at
+ * their entries, so finding a word never reads pmem and only the count
+ * it bumps is written there.  Entries are only ever added at the head
+ * of a list, so lookups take no lock; inserting takes the bucket's lock
+ * word, and a lookup that misses rechecks under it.  A bucket is filled
+ * from pmem the first time it is used, so opening a pool costs the same
+ * however big its table is.
+ */
+struct ient {
+	struct ient *next;
+	uint64_t hash;		/* freq_hash64(word) */
+	struct entry *pe;	/* run-time pointer to the entry in pmem */
+	char word[];
+};
+
+struct ibucket {
+	struct ient *entries;
+	uint32_t lock;		/* held while adding to the bucket */
+	uint32_t filled;	/* entries has all of the pmem bucket */
+};
+
+/* lock words for the entries' counts, picked by address */
+#define NLOCKS_BITS	10
+#define NLOCKS		(1 << NLOCKS_BITS)
+
+/*
+ * the allocation class for entries: one unit holds an entry and its
+ * compact header, and a unit is a cache line so flushing an entry's
+ * count or next never spans two lines
+ */
+#define ENTRY_UNIT	64
+#define ENTRY_UNITS	4096	/* units per block of them */
+
+/* the size of POBJ_HEADER_COMPACT, what every allocation here has */
+#define ALLOC_HEADER	16
+
+_Static_assert(sizeof(struct entry) + ALLOC_HEADER <= ENTRY_UNIT,
+		"struct entry outgrew its allocation class");
+
+struct ptable {
+	struct freq_table base;
+	PMEMobjpool *pop;	/* pmemobj pool pointer */
+	struct bucket *H;	/* run-time pointer to H[] in pmem */
+	struct ibucket *I;	/* the index for H[], NULL with it */
+	uint32_t locks[NLOCKS];	/* see entry_lock() */
+	int shared_heap;	/* FREQ_PMEM_SHARED_HEAP */
+	unsigned entry_class;	/* allocation class id for entries */
+	uint64_t opened;	/* which freq_pmem_open() this is */
+	int rdonly;		/* FREQ_PMEM_RDONLY */
+};
+
+static uint64_t Opened;		/* freq_pmem_open() calls so far */
+
+#ifdef FREQ_CRASH_POINTS
+/*
+ * for freq_pmem_crash, which links a copy of this file built with
+ * FREQ_CRASH_POINTS: with FREQ_PMEM_CRASH=point:n in the environment the
+ * process kills itself the nth time it reaches point, in a transaction
+ * that has made its changes but not committed them
+ */
+static const char *CrashPoint;	/* NULL for none */
+static size_t CrashLen;
+static uint64_t CrashAt;
+
+static void crash_setup(void)
+{
+	const char *s = getenv("FREQ_PMEM_CRASH");
+	const char *colon;
+
+	if (CrashPoint != NULL || s == NULL ||
+	    (colon = strchr(s, ':')) == NULL)
+		return;
+
+	CrashLen = colon - s;
+	CrashAt = strtoull(colon + 1, NULL, 0);
+	CrashPoint = s;
+}
+
+static void crash_point(const char *point)
+{
+	if (CrashPoint != NULL && strlen(point) == CrashLen &&
+	    memcmp(point, CrashPoint, CrashLen) == 0 &&
+	    __atomic_sub_fetch(&CrashAt, 1, __ATOMIC_RELAXED) == 0)
+		raise(SIGKILL);
+}
+
+#define CRASH_POINT(point)	crash_point(point)
+#else
+#define CRASH_POINT(point)	((void)0)
+#endif
+
+/*
+ * the arenas this thread allocates from, one per thread so inserting
+ * threads don't contend in the allocator; made on a thread's first
+ * insert into an open pool and kept for the pool's next inserts, in a
+ * few slots so a thread moving between pools doesn't make an arena
+ * every time it moves.  An arena lasts as long as the open pool does.
+ */
+#define ARENA_SLOTS	8
+
+static __thread struct {
+	uint64_t opened;	/* the ptable's opened, 0 for an empty slot */
+	unsigned arena;
+} Arenas[ARENA_SLOTS];
+static __thread unsigned ArenaNext;	/* slot to reuse when all are full */
+
+/* pmemobj_tx_xalloc() flags for an insert by this thread */
+static uint64_t alloc_flags(struct ptable *pt)
+{
+	unsigned i;
+
+	if (pt->shared_heap)
+		return 0;
+
+	for (i = 0; i < ARENA_SLOTS; i++)
+		if (Arenas[i].opened == pt->opened)
+			return POBJ_ARENA_ID(Arenas[i].arena);
+
+	i = ArenaNext++ % ARENA_SLOTS;
+	if (pmemobj_ctl_exec(pt->pop, "heap.arena.create",
+			&Arenas[i].arena) != 0)
+		errx(1, "can't create arena: %s", pmemobj_errormsg());
+	Arenas[i].opened = pt->opened;
+
+	return POBJ_ARENA_ID(Arenas[i].arena);
+}
+
+/*
+ * the lock word for an entry's count.  Keeping locks out of pmem keeps
+ * them out of the pool and out of what a bump writes there; an entry
+ * never moves while the pool is open, so its address, that is its
+ * offset in the pool, picks the same lock every time.
+ */
+static unsigned entry_lock(const struct entry *pe)
+{
+	return ((uintptr_t)pe >> 4) * 0x9e3779b97f4a7c15ULL >>
+			(64 - NLOCKS_BITS);
+}
+
+/* the entry for a word in an index bucket, NULL if it has none */
+static struct entry *ilookup(struct ibucket *ib, const char *word,
+		uint64_t hash)
+{
+	struct ient *ie = __atomic_load_n(&ib->entries, __ATOMIC_ACQUIRE);
+
+	for (; ie != NULL; ie = ie->next)
+		if (ie->hash == hash && strcmp(word, ie->word) == 0)
+			return ie->pe;
+
+	return NULL;
+}
+
+/* index an entry, with the bucket locked or not yet shared */
+static void iadd(struct ibucket *ib, const char *word, size_t len,
+		uint64_t hash, struct entry *pe)
+{
+	struct ient *ie;
+
+	if ((ie = malloc(sizeof(*ie) + len + 1)) == NULL)
+		err(1, "malloc");
+
+	ie->hash = hash;
+	ie->pe = pe;
+	memcpy(ie->word, word, len + 1);
+	ie->next = ib->entries;
+
+	/* the entry is filled in before lookups can find it */
+	__atomic_store_n(&ib->entries, ie, __ATOMIC_RELEASE);
+}
+
+/* index bucket h, filling it from pmem if this is its first use */
+static struct ibucket *ibucket(struct ptable *pt, unsigned h)
+{
+	struct ibucket *ib = &pt->I[h];
+
+	if (__atomic_load_n(&ib->filled, __ATOMIC_ACQUIRE))
+		return ib;
+
+	freq_lock(&ib->lock);
+
+	if (!ib->filled) {
+		TOID(struct entry) ep = pt->H[h].entries;
+
+		for (; !TOID_IS_NULL(ep); ep = D_RO(ep)->next) {
+			const char *word = D_RO(D_RO(ep)->word);
+			size_t len = strlen(word);
+
+			iadd(ib, word, len, freq_hash64(word, len), D_RW(ep));
+		}
+
+		__atomic_store_n(&ib->filled, 1, __ATOMIC_RELEASE);
+	}
+
+	freq_unlock(&ib->lock);
+	return ib;
+}
+
+/* a new entry for a word, inside a transaction */
+static TOID(struct entry) tx_entry(struct ptable *pt, const char *word,
+		size_t len, uint64_t n)
+{
+	uint64_t flags = alloc_flags(pt);
+	TOID(struct entry) ep;
+	TOID(char) wp;
+
+	/* allocate entry struct and fill it in */
+	ep = TX_XALLOC(struct entry, sizeof(struct entry), flags |
+			POBJ_XALLOC_ZERO | POBJ_CLASS_ID(pt->entry_class));
+
+	/* new in this transaction, so no need to add it */
+	wp = TX_XALLOC(char, len + 1, flags);
+	memcpy(D_RW(wp), word, len + 1);
+	D_RW(ep)->word = wp;
+
+	D_RW(ep)->count = n;
+	return ep;
+}
+
+/* new entry for a word at the head of bucket b, inside a transaction */
+static struct entry *tx_insert(struct ptable *pt, struct bucket *b,
+		const char *word, size_t len, uint64_t n)
+{
+	TOID(struct entry) ep = tx_entry(pt, word, len, n);
+
+	/* add field being changed to transaction */
+	pmemobj_tx_add_range_direct(&b->entries, sizeof(b->entries));
+
+	/* add it to the front of the linked list */
+	D_RW(ep)->next = b->entries;
+	b->entries = ep;
+
+	return D_RW(ep);
+}
+
+/* add n to the count for a word whose freq_hash() is h */
+void freq_pmem_add(struct freq_table *t, const char *word, unsigned h,
+		uint64_t n)
+{
+	struct ptable *pt = (struct ptable *)t;
+	size_t len = strlen(word);
+	uint64_t hash = freq_hash64(word, len);
+	struct ibucket *ib = ibucket(pt, h);
+	struct entry *pe;
+
+	if ((pe = ilookup(ib, word, hash)) == NULL) {
+		freq_lock(&ib->lock);
+
+		/* another thread may have added the word before we locked */
+		if ((pe = ilookup(ib, word, hash)) == NULL) {
+			TX_BEGIN(pt->pop) {
+				pe = tx_insert(pt, &pt->H[h], word, len, n);
+				CRASH_POINT("count");
+			} TX_ONABORT {
+				err(1, "can't create entry for \"%s\"", word);
+			} TX_END
+
+			iadd(ib, word, len, hash, pe);
+			freq_unlock(&ib->lock);
+			return;
+		}
+
+		freq_unlock(&ib->lock);
+	}
+
+	/* already in table, lock the entry and update it transactionally */
+	uint32_t *l = &pt->locks[entry_lock(pe)];
+
+	freq_lock(l);
+
+	TX_BEGIN(pt->pop) {
+		TX_ADD_FIELD_DIRECT(pe, count);
+		pe->count = freq_sat_add(pe->count, n);
+		CRASH_POINT("count");
+	} TX_ONABORT {
+		err(1, "can't bump count for \"%s\"", word);
+	} TX_END
+
+	freq_unlock(l);
+}
+
+/* add n to the count for a word */
+static void pmem_add(struct freq_table *t, const char *word, uint64_t n)
+{
+	freq_pmem_add(t, word, freq_hash(word), n);
+}
+
+/* bump the count for a word */
+static void pmem_count(struct freq_table *t, const char *word)
+{
+	freq_pmem_add(t, word, freq_hash(word), 1);
+}
+
+/*
+ * the locks of the entries for words i to j - 1 of w, in order and
+ * once each, into held; *miss gets the number of words not indexed
+ */
+static size_t batch_locks(struct ibucket *ib, const struct freq_bword *w,
+		size_t i, size_t j, unsigned *held, size_t *miss)
+{
+	size_t nheld = 0;
+
+	*miss = 0;
+
+	for (size_t k = i; k < j; k++) {
+		struct entry *pe = ilookup(ib, w[k].word,
+				freq_hash64(w[k].word, w[k].len));
+		unsigned l;
+		size_t m;
+
+		if (pe == NULL) {
+			(*miss)++;
+			continue;
+		}
+
+		/* insertion sort, a bucket only has a few words a batch */
+		l = entry_lock(pe);
+		for (m = nheld; m > 0 && held[m - 1] > l; m--)
+			;
+		if (m > 0 && held[m - 1] == l)
+			continue;
+		memmove(&held[m + 1], &held[m], (nheld - m) * sizeof(*held));
+		held[m] = l;
+		nheld++;
+	}
+
+	return nheld;
+}
+
+/*
+ * add the counts of a batch of words sorted by bucket, one transaction
+ * for all the words of each bucket.  Words already in the index only
+ * lock their entries, taking the locks in order so batches can't
+ * deadlock; the index bucket's lock word, which also covers the pmem
+ * bucket, is only taken when some word is new to it.
+ */
+static void pmem_count_batch(struct freq_table *t, const struct freq_bword *w,
+		size_t n)
+{
+	struct ptable *pt = (struct ptable *)t;
+	unsigned held[FREQ_BATCH];
+	size_t i, j;
+
+	for (i = 0; i < n; i = j) {
+		unsigned h = w[i].h;
+		struct ibucket *ib = ibucket(pt, h);
+		struct ibucket fresh = { NULL };
+		size_t nheld, miss;
+		int locked = 0;
+
+		for (j = i; j < n && w[j].h == h; j++)
+			;
+
+		/* the index can only change under its lock, look again */
+		nheld = batch_locks(ib, w, i, j, held, &miss);
+
+		if (miss != 0) {
+			freq_lock(&ib->lock);
+			locked = 1;
+			nheld = batch_locks(ib, w, i, j, held, &miss);
+		}
+
+		for (size_t l = 0; l < nheld; l++)
+			freq_lock(&pt->locks[held[l]]);
+
+		TX_BEGIN(pt->pop) {
+			for (size_t k = i; k < j; k++) {
+				uint64_t hash = freq_hash64(w[k].word,
+						w[k].len);
+				struct entry *pe = ilookup(ib, w[k].word, hash);
+
+				if (pe != NULL) {
+					TX_ADD_FIELD_DIRECT(pe, count);
+					pe->count = freq_sat_add(pe->count,
+							w[k].n);
+					continue;
+				}
+
+				/* indexed once it is committed, below */
+				pe = tx_insert(pt, &pt->H[h], w[k].word,
+						w[k].len, w[k].n);
+				iadd(&fresh, w[k].word, w[k].len, hash, pe);
+			}
+			CRASH_POINT("count");
+		} TX_ONABORT {
+			err(1, "can't count batch in bucket %u", h);
+		} TX_END
+
+		for (size_t l = 0; l < nheld; l++)
+			freq_unlock(&pt->locks[held[l]]);
+
+		if (miss) {
+			struct ient *last = fresh.entries;
+
+			while (last->next != NULL)
+				last = last->next;
+
+			last->next = ib->entries;
+			__atomic_store_n(&ib->entries, fresh.entries,
+					__ATOMIC_RELEASE);
+		}
+
+		if (locked)
+			freq_unlock(&ib->lock);
+	}
+}
+
+/* call fn for every entry in buckets first, first + step, ... */
+static void walk_buckets(struct bucket *H, unsigned first, unsigned step,
+		freq_walk_fn fn, void *arg)
+{
+	/* no table allocated yet, treat like empty table */
+	if (H == NULL)
+		return;
+
+	for (unsigned i = first; i < FREQ_NBUCKETS; i += step) {
+		TOID(struct entry) ep = H[i].entries;
+
+		for (; !TOID_IS_NULL(ep); ep = D_RO(ep)->next)
+			fn(D_RO(D_RO(ep)->word), D_RO(ep)->count, arg);
+	}
+}
+
+/* call fn for every entry in the table */
+static void pmem_walk(struct freq_table *t, freq_walk_fn fn, void *arg)
+{
+	walk_buckets(((struct ptable *)t)->H, 0, 1, fn, arg);
+}
+
+/* a word's bucket is its freq_hash(), so a part is every nparts'th one */
+static void pmem_walk_part(struct freq_table *t, unsigned part,
+		unsigned nparts, freq_walk_fn fn, void *arg)
+{
+	walk_buckets(((struct ptable *)t)->H, part, nparts, fn, arg);
+}
+
+/* empty an index bucket, it is filled again on its next use */
+static void iclear(struct ibucket *ib)
+{
+	struct ient *ie, *next;
+
+	for (ie = ib->entries; ie != NULL; ie = next) {
+		next = ie->next;
+		free(ie);
+	}
+
+	ib->entries = NULL;
+	ib->filled = 0;
+}
+
+void freq_pmem_stats(struct freq_table *t, struct freq_stats *st)
+{
+	struct bucket *H = ((struct ptable *)t)->H;
+
+	memset(st, 0, sizeof(*st));
+
+	if (H == NULL)
+		return;
+
+	PMEMoid hoid = pmemobj_oid(H);
+
+	st->bucket_bytes = sizeof(*H) * FREQ_NBUCKETS;
+	st->overhead_bytes = pmemobj_alloc_usable_size(hoid) -
+			st->bucket_bytes + ALLOC_HEADER;
+
+	for (int i = 0; i < FREQ_NBUCKETS; i++) {
+		TOID(struct entry) ep = H[i].entries;
+
+		for (; !TOID_IS_NULL(ep); ep = D_RO(ep)->next) {
+			TOID(char) wp = D_RO(ep)->word;
+			size_t len = strlen(D_RO(wp)) + 1;
+
+			st->entries++;
+			st->entry_bytes += sizeof(struct entry);
+			st->word_bytes += len;
+			st->overhead_bytes +=
+					pmemobj_alloc_usable_size(ep.oid) -
+					sizeof(struct entry) +
+					pmemobj_alloc_usable_size(wp.oid) -
+					len + 2 * ALLOC_HEADER;
+		}
+	}
+}
+
+/* close the pool, the table itself stays behind in pmem */
+static void pmem_close(struct freq_table *t)
+{
+	struct ptable *pt = (struct ptable *)t;
+
+	if (pt->I != NULL) {
+		for (int i = 0; i < FREQ_NBUCKETS; i++)
+			iclear(&pt->I[i]);
+		free(pt->I);
+	}
+
+	pmemobj_close(pt->pop);
+	free(t);
+}
+
+static const struct freq_ops pmem_ops = {
+	.name = "pmem",
+	.count = pmem_count,
+	.add = pmem_add,
+	.count_batch = pmem_count_batch,
+	.walk = pmem_walk,
+	.walk_part = pmem_walk_part,
+	.close = pmem_close,
+};
+
+/* record that every bucket is in the given layout now */
+static void migrated(PMEMobjpool *pop, TOID(struct root) root,
+		uint64_t layout)
+{
+	TX_BEGIN(pop) {
+		TX_ADD(root);
+		D_RW(root)->layout = layout;
+		D_RW(root)->migrated = 0;
+	} TX_ONABORT {
+		err(1, "can't update layout version");
+	} TX_END
+}
+
+/*
+ * widen the int counts of a LAYOUT_INT_COUNT table to uint64_t; the int
+ * sat in the low half of what is now the uint64_t, so the conversion
+ * keeps those 32 bits and zeroes the rest.  Each bucket is converted in
+ * its own transaction that also records the progress in the root, so a
+ * migration that is interrupted picks up where it left off next time.
+ */
+static void migrate_int_counts(PMEMobjpool *pop, TOID(struct root) root)
+{
+	struct bucket_rwlock *H = pmemobj_direct(D_RO(root)->h.oid);
+
+	for (uint64_t i = D_RO(root)->migrated; i < FREQ_NBUCKETS; i++) {
+		TX_BEGIN(pop) {
+			TOID(struct entry) ep = H[i].entries;
+
+			while (!TOID_IS_NULL(ep)) {
+				struct entry_mutex *e = pmemobj_direct(ep.oid);
+
+				TX_ADD_FIELD_DIRECT(e, count);
+				e->count = (uint32_t)e->count;
+				ep = e->next;
+			}
+
+			TX_ADD_FIELD(root, migrated);
+			D_RW(root)->migrated = i + 1;
+			CRASH_POINT("migrate");
+		} TX_ONABORT {
+			err(1, "can't migrate bucket %" PRIu64, i);
+		} TX_END
+	}
+
+	migrated(pop, root, LAYOUT_U64_COUNT);
+}
+
+/*
+ * copy the entries of a LAYOUT_U64_COUNT table into entries without the
+ * PMEMmutex and free the old ones, a bucket at a time as above; the new
+ * entries are allocated as tx_entry() does, so they pack the same way
+ */
+static void migrate_entry_mutex(struct ptable *pt, TOID(struct root) root)
+{
+	struct bucket_rwlock *H = pmemobj_direct(D_RO(root)->h.oid);
+	uint64_t flags = alloc_flags(pt);
+
+	for (uint64_t i = D_RO(root)->migrated; i < FREQ_NBUCKETS; i++) {
+		TX_BEGIN(pt->pop) {
+			TOID(struct entry) ep = H[i].entries;
+			TOID(struct entry) *tail = &H[i].entries;
+
+			pmemobj_tx_add_range_direct(&H[i].entries,
+					sizeof(H[i].entries));
+
+			while (!TOID_IS_NULL(ep)) {
+				struct entry_mutex *e = pmemobj_direct(ep.oid);
+				TOID(struct entry) nep = TX_XALLOC(struct entry,
+						sizeof(struct entry), flags |
+						POBJ_XALLOC_ZERO |
+						POBJ_CLASS_ID(pt->entry_class));
+
+				D_RW(nep)->word = e->word;
+				D_RW(nep)->count = e->count;
+
+				/* keep the order, new entry ends the list */
+				*tail = nep;
+				tail = &D_RW(nep)->next;
+
+				TOID(struct entry) next = e->next;
+
+				TX_FREE(ep);
+				ep = next;
+			}
+
+			TX_ADD_FIELD(root, migrated);
+			D_RW(root)->migrated = i + 1;
+			CRASH_POINT("migrate");
+		} TX_ONABORT {
+			err(1, "can't migrate bucket %" PRIu64, i);
+		} TX_END
+	}
+
+	migrated(pt->pop, root, LAYOUT_NO_MUTEX);
+}
+
+/*
+ * copy the buckets of a LAYOUT_NO_MUTEX table into an array without the
+ * PMEMrwlocks and free the old one.  The array is small, so it is done
+ * in one transaction and an interrupted migration has nothing to resume.
+ */
+static void migrate_bucket_rwlock(PMEMobjpool *pop, TOID(struct root) root)
+{
+	struct bucket_rwlock *H = pmemobj_direct(D_RO(root)->h.oid);
+
+	TX_BEGIN(pop) {
+		TOID(struct bucket) nh = TX_ZALLOC(struct bucket,
+				sizeof(struct bucket) * FREQ_NBUCKETS);
+
+		for (int i = 0; i < FREQ_NBUCKETS; i++)
+			D_RW(nh)[i].entries = H[i].entries;
+
+		TX_FREE(D_RO(root)->h);
+		TX_ADD(root);
+		D_RW(root)->h = nh;
+		D_RW(root)->layout = LAYOUT_NO_RWLOCK;
+		D_RW(root)->migrated = 0;
+		CRASH_POINT("migrate");
+	} TX_ONABORT {
+		err(1, "can't migrate the buckets");
+	} TX_END
+}
+
+/* read one of libpmemobj's heap statistics */
+static uint64_t heap_stat(PMEMobjpool *pop, const char *name)
+{
+	uint64_t v;
+
+	if (pmemobj_ctl_get(pop, name, &v) != 0)
+		errx(1, "%s: %s", name, pmemobj_errormsg());
+
+	return v;
+}
+
+void freq_pmem_usage(struct freq_table *t, struct freq_pmem_usage *u)
+{
+	PMEMobjpool *pop = ((struct ptable *)t)->pop;
+	PMEMoid oid;
+
+	memset(u, 0, sizeof(*u));
+
+	u->heap_allocated = heap_stat(pop, "stats.heap.curr_allocated");
+	u->run_allocated = heap_stat(pop, "stats.heap.run_allocated");
+	u->run_active = heap_stat(pop, "stats.heap.run_active");
+
+	for (oid = pmemobj_first(pop); !OID_IS_NULL(oid);
+			oid = pmemobj_next(oid)) {
+		uint64_t size = pmemobj_alloc_usable_size(oid);
+		size_t i;
+
+		u->nallocs++;
+		u->bytes += size + ALLOC_HEADER;
+
+		/* keep the sizes in order, lumping any past the last */
+		for (i = 0; i < u->nsizes && u->sizes[i].size < size; i++)
+			;
+
+		if (i < u->nsizes && u->sizes[i].size == size)
+			u->sizes[i].count++;
+		else if (u->nsizes == FREQ_PMEM_NSIZES)
+			u->other_count++;
+		else {
+			memmove(&u->sizes[i + 1], &u->sizes[i],
+					(u->nsizes - i) * sizeof(u->sizes[0]));
+			u->sizes[i].size = size;
+			u->sizes[i].count = 1;
+			u->nsizes++;
+		}
+	}
+}
+
+/* words read from a run by freq_pmem_import(), waiting to be added */
+#define IMPORT_BATCH	4096
+
+struct import {
+	struct ptable *pt;
+	size_t n;
+	struct {
+		char *word;
+		uint64_t count;
+	} w[IMPORT_BATCH];
+};
+
+/*
+ * add n to the count for a word inside a transaction, for bulk loads
+ * into a table nothing else is counting into, so no entry is locked and
+ * a new one is indexed right away; a transaction that aborts exits
+ */
+static void tx_add(struct ptable *pt, const char *word, uint64_t n)
+{
+	size_t len = strlen(word);
+	uint64_t hash = freq_hash64(word, len);
+	unsigned h = freq_hash(word);
+	struct ibucket *ib = ibucket(pt, h);
+	struct entry *pe = ilookup(ib, word, hash);
+
+	if (pe != NULL) {
+		TX_ADD_FIELD_DIRECT(pe, count);
+		pe->count = freq_sat_add(pe->count, n);
+		return;
+	}
+
+	pe = tx_insert(pt, &pt->H[h], word, len, n);
+	iadd(ib, word, len, hash, pe);
+}
+
+/* add the counts of the words gathered so far, in one transaction */
+static void import_flush(struct import *im)
+{
+	struct ptable *pt = im->pt;
+
+	TX_BEGIN(pt->pop) {
+		for (size_t i = 0; i < im->n; i++)
+			tx_add(pt, im->w[i].word, im->w[i].count);
+	} TX_ONABORT {
+		err(1, "can't import a batch of %zu words", im->n);
+	} TX_END
+
+	for (size_t i = 0; i < im->n; i++)
+		free(im->w[i].word);
+	im->n = 0;
+}
+
+/* freq_walk_fn for freq_run_merge(), never called twice at once */
+static void import_entry(const char *word, uint64_t count, void *arg)
+{
+	struct import *im = arg;
+
+	if ((im->w[im->n].word = strdup(word)) == NULL)
+		err(1, "strdup");
+	im->w[im->n++].count = count;
+
+	if (im->n == IMPORT_BATCH)
+		import_flush(im);
+}
+
+/*
+ * add the counts in a run to the table, reading its parts in parallel
+ * and adding them IMPORT_BATCH words to a transaction; the table's
+ * buckets are fixed by its layout, so there is nothing to size first
+ */
+void freq_pmem_import(struct freq_table *t, const char *path)
+{
+	struct import *im;
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (((struct ptable *)t)->H == NULL)
+		errx(1, "%s: no table to import into", path);
+
+	if ((im = calloc(1, sizeof(*im))) == NULL)
+		err(1, "calloc");
+	im->pt = (struct ptable *)t;
+
+	freq_run_merge(&path, 1, ncpus < 1 ? 1 : ncpus, import_entry, im);
+	if (im->n != 0)
+		import_flush(im);
+
+	free(im);
+}
+
+/* a freq_pmem_merge() in progress, and a thread's part of it */
+#define MERGE_BATCH	4096	/* words to a transaction, about */
+
+struct merge {
+	struct ptable *dst, *src;
+	struct mergelog *log;
+};
+
+struct mrange {
+	struct merge *m;
+	unsigned r;
+};
+
+/*
+ * thread start routine, merge one range of buckets, whole buckets to a
+ * transaction until it has MERGE_BATCH words; a word's bucket is the
+ * same in both tables, so no other range's thread touches its buckets
+ */
+static void *merge_range(void *arg)
+{
+	struct merge *m = ((struct mrange *)arg)->m;
+	unsigned r = ((struct mrange *)arg)->r;
+	uint64_t *next = &m->log->next[r];
+	uint64_t end = FREQ_NBUCKETS * (r + 1) / m->log->nranges;
+
+	while (*next < end) {
+		TX_BEGIN(m->dst->pop) {
+			uint64_t b = *next;
+
+			for (size_t n = 0; b < end && n < MERGE_BATCH; b++) {
+				TOID(struct entry) ep = m->src->H[b].entries;
+
+				for (; !TOID_IS_NULL(ep); ep = D_RO(ep)->next) {
+					tx_add(m->dst, D_RO(D_RO(ep)->word),
+							D_RO(ep)->count);
+					n++;
+				}
+			}
+
+			pmemobj_tx_add_range_direct(next, sizeof(*next));
+			*next = b;
+			CRASH_POINT("merge");
+		} TX_ONABORT {
+			err(1, "can't merge bucket %" PRIu64, *next);
+		} TX_END
+	}
+
+	return NULL;
+}
+
+void freq_pmem_merge(struct freq_table *dst, struct freq_table *src,
+		unsigned nthreads)
+{
+	struct merge m = {
+		.dst = (struct ptable *)dst,
+		.src = (struct ptable *)src,
+	};
+	PMEMobjpool *pop = m.dst->pop;
+	TOID(struct root) root = POBJ_ROOT(pop, struct root);
+
+	if (m.dst->H == NULL)
+		errx(1, "no table to merge into");
+	if (m.dst->rdonly)
+		errx(1, "can't merge into a table opened read-only");
+	if (m.src->H == NULL)
+		return;
+
+	uint64_t source = pmemobj_oid(m.src->H).pool_uuid_lo;
+
+	if (source == pmemobj_oid(m.dst->H).pool_uuid_lo)
+		errx(1, "can't merge a pool into itself");
+
+	if (nthreads < 1)
+		nthreads = 1;
+	if (nthreads > FREQ_MAXPARTS)
+		nthreads = FREQ_MAXPARTS;
+
+	/* start a merge, unless one from the same pool is to be resumed */
+	if (TOID_IS_NULL(D_RO(root)->merge)) {
+		TX_BEGIN(pop) {
+			TOID(struct mergelog) lp = TX_ZALLOC(struct mergelog,
+					sizeof(struct mergelog) +
+					nthreads * sizeof(uint64_t));
+
+			D_RW(lp)->source = source;
+			D_RW(lp)->nranges = nthreads;
+			for (unsigned r = 0; r < nthreads; r++)
+				D_RW(lp)->next[r] = FREQ_NBUCKETS * r /
+						nthreads;
+
+			TX_ADD_FIELD(root, merge);
+			D_RW(root)->merge = lp;
+		} TX_ONABORT {
+			err(1, "can't start merge");
+		} TX_END
+	} else if (D_RO(D_RO(root)->merge)->source != source)
+		errx(1, "another pool's merge into this one is unfinished");
+
+	m.log = D_RW(D_RW(root)->merge);
+
+	/* a resumed merge keeps the ranges it started with */
+	unsigned nranges = m.log->nranges;
+	struct mrange ranges[nranges];
+	pthread_t tids[nranges];
+
+	for (unsigned r = 0; r < nranges; r++) {
+		ranges[r].m = &m;
+		ranges[r].r = r;
+		if ((errno = pthread_create(&tids[r], NULL, merge_range,
+				&ranges[r])) != 0)
+			err(1, "pthread_create %u of %u", r, nranges);
+	}
+
+	for (unsigned r = 0; r < nranges; r++)
+		pthread_join(tids[r], NULL);
+
+	TX_BEGIN(pop) {
+		TX_FREE(D_RO(root)->merge);
+		TX_ADD_FIELD(root, merge);
+		D_RW(root)->merge = TOID_NULL(struct mergelog);
+	} TX_ONABORT {
+		err(1, "can't finish merge");
+	} TX_END
+}
+
+/*
+ * copy each bucket's entries and words, in list order, into new ones
+ * and free the old ones, a bucket per transaction.  The new ones come
+ * from this thread's arena and the entries from their class, so each
+ * bucket's entries end up next to each other and a walk goes through
+ * the pool in order.  An interrupted compaction leaves every bucket
+ * either compacted or as it was.
+ */
+void freq_pmem_compact(struct freq_table *t)
+{
+	struct ptable *pt = (struct ptable *)t;
+
+	if (pt->H == NULL)
+		return;
+
+	for (int i = 0; i < FREQ_NBUCKETS; i++) {
+		TX_BEGIN(pt->pop) {
+			TOID(struct entry) ep = pt->H[i].entries;
+			TOID(struct entry) *tail = &pt->H[i].entries;
+
+			pmemobj_tx_add_range_direct(tail, sizeof(*tail));
+
+			while (!TOID_IS_NULL(ep)) {
+				const char *word = D_RO(D_RO(ep)->word);
+				TOID(struct entry) nep = tx_entry(pt, word,
+						strlen(word), D_RO(ep)->count);
+				TOID(struct entry) next = D_RO(ep)->next;
+
+				*tail = nep;
+				tail = &D_RW(nep)->next;
+
+				TX_FREE(D_RO(ep)->word);
+				TX_FREE(ep);
+				ep = next;
+			}
+			CRASH_POINT("compact");
+		} TX_ONABORT {
+			err(1, "can't compact bucket %d", i);
+		} TX_END
+
+		/* the index pointed at the old entries */
+		iclear(&pt->I[i]);
+	}
+}
+
+/* create a pool for freq_pmem_open(), as pmempool create obj does */
+void freq_pmem_create(const char *path, uint64_t size)
+{
+	PMEMobjpool *pop = pmemobj_create(path, POBJ_LAYOUT_NAME(freq), size,
+			0666);
+
+	if (pop == NULL)
+		err(1, "pmemobj_create: %s", path);
+
+	pmemobj_close(pop);
+}
+
+/*
+ * the layout of the table a root points to; a root read without growing
+ * it may be too short to have the field, from before it was recorded
+ */
+static uint64_t root_layout(PMEMobjpool *pop, TOID(struct root) root)
+{
+	if (pmemobj_root_size(pop) < offsetof(struct root, layout) +
+			sizeof(D_RO(root)->layout))
+		return LAYOUT_INT_COUNT;
+
+	return D_RO(root)->layout;
+}
+
+/* open the word table in a pmem pool, safe for concurrent count() calls */
+struct freq_table *freq_pmem_open(const char *path, int flags)
+{
+	struct ptable *pt;
+
+	if ((pt = calloc(1, sizeof(*pt))) == NULL)
+		err(1, "calloc");
+
+	pt->opened = __atomic_add_fetch(&Opened, 1, __ATOMIC_RELAXED);
+#ifdef FREQ_CRASH_POINTS
+	crash_setup();
+#endif
+	pt->pop = pmemobj_open(path, POBJ_LAYOUT_NAME(freq));
+
+	if (pt->pop == NULL)
+		err(1, "pmemobj_open: %s", path);
+
+	/*
+	 * keep libpmemobj's heap statistics for freq_pmem_usage(); the
+	 * persistent ones are only exact if they have always been kept.
+	 * Read-only nothing is allocated, so neither they nor our class
+	 * are needed, and turning the persistent ones on would write.
+	 */
+	if (!(flags & FREQ_PMEM_RDONLY)) {
+		enum pobj_stats_enabled stats = POBJ_STATS_ENABLED_BOTH;
+
+		if (pmemobj_ctl_set(pt->pop, "stats.enabled", &stats) != 0)
+			errx(1, "%s: can't enable statistics: %s", path,
+					pmemobj_errormsg());
+	}
+
+	/* classes only last while the pool is open, register ours again */
+	if (flags & FREQ_PMEM_SHARED_HEAP)
+		pt->shared_heap = 1;
+	else if (!(flags & FREQ_PMEM_RDONLY)) {
+		struct pobj_alloc_class_desc d = {
+			.unit_size = ENTRY_UNIT,
+			.units_per_block = ENTRY_UNITS,
+			.header_type = POBJ_HEADER_COMPACT,
+		};
+
+		if (pmemobj_ctl_set(pt->pop, "heap.alloc_class.new.desc",
+				&d) != 0)
+			errx(1, "%s: can't add allocation class: %s", path,
+					pmemobj_errormsg());
+		pt->entry_class = d.class_id;
+	}
+
+	TOID(struct root) root;
+
+	/*
+	 * POBJ_ROOT() grows a root from an older version, so read-only the
+	 * root is taken as it is; only the fields every version has are used
+	 */
+	if (flags & FREQ_PMEM_RDONLY) {
+		TOID_ASSIGN(root, pmemobj_root(pt->pop, 0));
+		if (TOID_IS_NULL(root) || pmemobj_root_size(pt->pop) <
+				offsetof(struct root, h) +
+				sizeof(D_RO(root)->h))
+			errx(1, "%s: no table", path);
+		pt->rdonly = 1;
+	} else
+		root = POBJ_ROOT(pt->pop, struct root);
+
+	/* before starting, see if buckets have been allocated */
+	if (TOID_IS_NULL(D_RO(root)->h) && (flags & FREQ_PMEM_CREATE) &&
+	    !(flags & FREQ_PMEM_RDONLY)) {
+		/* nope, allocate it now */
+		TX_BEGIN(pt->pop) {
+			TX_ADD(root);
+			D_RW(root)->h = TX_ZALLOC(struct bucket,
+			    sizeof(struct bucket) * FREQ_NBUCKETS);
+			D_RW(root)->layout = LAYOUT_CURRENT;
+		} TX_ONABORT {
+			err(1, "cannot allocate hash table");
+		} TX_END
+	}
+
+	/* bring a table written by an older version up to date */
+	if (!TOID_IS_NULL(D_RO(root)->h)) {
+		uint64_t layout = root_layout(pt->pop, root);
+
+		if (layout > LAYOUT_CURRENT)
+			errx(1, "%s: unknown table layout %" PRIu64, path,
+					layout);
+
+		if (layout < LAYOUT_CURRENT &&
+		    (flags & FREQ_PMEM_RDONLY))
+			errx(1, "%s: table needs migrating, open it for "
+					"writing first", path);
+
+		if (D_RO(root)->layout == LAYOUT_INT_COUNT)
+			migrate_int_counts(pt->pop, root);
+
+		if (D_RO(root)->layout == LAYOUT_U64_COUNT)
+			migrate_entry_mutex(pt, root);
+
+		if (D_RO(root)->layout == LAYOUT_NO_MUTEX)
+			migrate_bucket_rwlock(pt->pop, root);
+	}
+
+	/* get run-time pointer to hash table, NULL if there is none */
+	if (!TOID_IS_NULL(D_RO(root)->h)) {
+		pt->H = D_RW(D_RW(root)->h);
+
+		/* empty, each bucket is indexed when first used */
+		if ((pt->I = calloc(FREQ_NBUCKETS, sizeof(*pt->I))) == NULL)
+			err(1, "calloc");
+	}
+
+	pt->base.ops = &pmem_ops;
+	return &pt->base;
+}
@@ -0,0 +1,565 @@
+/*
+ * be_volatile.c -- single-threaded word table in DRAM
+ *
+ * by default entries carry a 64-bit count and point to a separately
+ * allocated copy of the word.  With FREQ_COMPACT entries hold the word
+ * inline after a 32-bit count, and an entry whose count outgrows 32 bits
+ * is reallocated with a 64-bit count after the word (it "spills").
+ */
+#include <err.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libfreq.h"
+
+/* entries in a bucket are a linked list of struct entry */
+struct entry {
+	struct entry *next;
+	const char *word;
+	uint64_t count;
+};
+
+/* each bucket contains a pointer to the linked list of entries */
+struct bucket {
+	struct entry *entries;
+};
+
+struct vtable {
+	struct freq_table base;
+	struct freq_stats st;		/* all but bucket_bytes */
+	struct bucket H[FREQ_NBUCKETS];
+};
+
+/* count an entry into the table's stats, or with dir -1 out of them */
+static void vol_account(struct vtable *vt, struct entry *ep, int dir)
+{
+	size_t len = strlen(ep->word) + 1;
+	uint64_t d = dir;
+
+	vt->st.entries += d;
+	vt->st.entry_bytes += d * sizeof(*ep);
+	vt->st.word_bytes += d * len;
+	vt->st.overhead_bytes += d * (freq_malloc_overhead(ep, sizeof(*ep)) +
+			freq_malloc_overhead((char *)ep->word, len));
+}
+
+/* add a new entry for word with count n to the front of bucket bp */
+static void vol_insert(struct vtable *vt, struct bucket *bp, const char *word,
+		uint64_t n)
+{
+	struct entry *ep;
+
+	/* allocate new entry in table */
+	if ((ep = calloc(1, sizeof(*ep))) == NULL)
+		err(1, "calloc");
+
+	if ((ep->word = strdup(word)) == NULL)
+		err(1, "strdup");
+
+	ep->count = n;
+
+	/* add it to the front of the linked list */
+	ep->next = bp->entries;
+	bp->entries = ep;
+	vol_account(vt, ep, 1);
+}
+
+/* add n to the count for a word that hashes to bucket bp */
+static void vol_bump(struct vtable *vt, struct bucket *bp, const char *word,
+		uint64_t n)
+{
+	struct entry *ep = bp->entries;
+
+	for (; ep != NULL; ep = ep->next)
+		if (strcmp(word, ep->word) == 0) {
+			/* already in table, just bump the count */
+			ep->count = freq_sat_add(ep->count, n);
+			return;
+		}
+
+	vol_insert(vt, bp, word, n);
+}
+
+/* add n to the count for a word */
+static void vol_add(struct freq_table *t, const char *word, uint64_t n)
+{
+	struct vtable *vt = (struct vtable *)t;
+
+	vol_bump(vt, &vt->H[freq_hash(word)], word, n);
+}
+
+/* bump the count for a word */
+static void vol_count(struct freq_table *t, const char *word)
+{
+	vol_add(t, word, 1);
+}
+
+/* most lookups a count_batch() keeps in flight */
+#define MAXINFLIGHT 32
+
+/* what a lookup in flight waits for to be in cache */
+enum lstate {
+	L_IDLE,		/* nothing, the slot is free */
+	L_BUCKET,	/* its bucket head */
+	L_ENTRY,	/* the entry it is at */
+	L_WORD,		/* the word of that entry */
+};
+
+/* a lookup in flight in a count_batch() */
+struct lookup {
+	enum lstate state;
+	const struct freq_bword *w;
+	void *ep;			/* entry it is at */
+};
+
+/* move a lookup on to entry ep, or insert its word if there is none */
+static inline enum lstate vol_next(struct lookup *lp, struct entry *ep,
+		struct vtable *vt)
+{
+	if ((lp->ep = ep) == NULL) {
+		vol_insert(vt, &vt->H[lp->w->h], lp->w->word, lp->w->n);
+		return L_IDLE;
+	}
+
+	__builtin_prefetch(ep);
+	return L_ENTRY;
+}
+
+/*
+ * add the counts of a batch of words sorted by bucket, walking up to
+ * freq_prefetch chains at once: each lookup takes one step at a time
+ * in turn and prefetches what its next step needs, so the misses of
+ * one lookup are hidden behind the steps of the others
+ */
+static void vol_count_batch(struct freq_table *t, const struct freq_bword *w,
+		size_t n)
+{
+	struct vtable *vt = (struct vtable *)t;
+	struct bucket *H = vt->H;
+	struct lookup l[MAXINFLIGHT] = { { L_IDLE } };	/* L_IDLE, ep NULL */
+	size_t g = freq_prefetch < MAXINFLIGHT ? freq_prefetch : MAXINFLIGHT;
+	size_t next = 0, busy = 0;
+
+	if (g == 0) {
+		for (size_t i = 0; i < n; i++)
+			vol_bump(vt, &H[w[i].h], w[i].word, w[i].n);
+		return;
+	}
+
+	while (next < n || busy > 0)
+		for (size_t k = 0; k < g; k++) {
+			struct lookup *lp = &l[k];
+			struct entry *ep = lp->ep;
+
+			switch (lp->state) {
+			case L_IDLE:
+				if (next == n)
+					continue;
+				lp->w = &w[next++];
+				__builtin_prefetch(&H[lp->w->h]);
+				lp->state = L_BUCKET;
+				busy++;
+				continue;
+			case L_BUCKET:
+				lp->state = vol_next(lp, H[lp->w->h].entries,
+						vt);
+				break;
+			case L_ENTRY:
+				__builtin_prefetch(ep->word);
+				lp->state = L_WORD;
+				continue;
+			case L_WORD:
+				if (strcmp(lp->w->word, ep->word) != 0) {
+					lp->state = vol_next(lp, ep->next, vt);
+					break;
+				}
+				ep->count = freq_sat_add(ep->count, lp->w->n);
+				lp->state = L_IDLE;
+				break;
+			}
+
+			if (lp->state == L_IDLE)
+				busy--;
+		}
+}
+
+/* free every entry counted fewer than min times */
+static uint64_t vol_prune(struct freq_table *t, uint64_t min)
+{
+	struct vtable *vt = (struct vtable *)t;
+	struct entry **epp, *ep;
+	uint64_t removed = 0;
+
+	for (int i = 0; i < FREQ_NBUCKETS; i++)
+		for (epp = &vt->H[i].entries; (ep = *epp) != NULL; ) {
+			if (ep->count >= min) {
+				epp = &ep->next;
+				continue;
+			}
+			*epp = ep->next;
+			vol_account(vt, ep, -1);
+			free((char *)ep->word);
+			free(ep);
+			removed++;
+		}
+
+	return removed;
+}
+
+static uint64_t vol_size(struct freq_table *t)
+{
+	return ((struct vtable *)t)->st.entries;
+}
+
+static void vol_stats(struct freq_table *t, struct freq_stats *st)
+{
+	struct vtable *vt = (struct vtable *)t;
+
+	*st = vt->st;
+	st->bucket_bytes = sizeof(vt->H);
+}
+
+/* call fn for every entry in the table */
+static void vol_walk(struct freq_table *t, freq_walk_fn fn, void *arg)
+{
+	struct bucket *H = ((struct vtable *)t)->H;
+	struct entry *ep;
+
+	for (int i = 0; i < FREQ_NBUCKETS; i++)
+		for (ep = H[i].entries; ep != NULL; ep = ep->next)
+			fn(ep->word, ep->count, arg);
+}
+
+/* free every entry and the table itself */
+static void vol_close(struct freq_table *t)
+{
+	struct bucket *H = ((struct vtable *)t)->H;
+	struct entry *ep, *next;
+
+	for (int i = 0; i < FREQ_NBUCKETS; i++)
+		for (ep = H[i].entries; ep != NULL; ep = next) {
+			next = ep->next;
+			free((char *)ep->word);
+			free(ep);
+		}
+
+	free(t);
+}
+
+static const struct freq_ops vol_ops = {
+	.name = "volatile",
+	.count = vol_count,
+	.add = vol_add,
+	.count_batch = vol_count_batch,
+	.prune = vol_prune,
+	.size = vol_size,
+	.stats = vol_stats,
+	.walk = vol_walk,
+	.close = vol_close,
+};
+
+/* compact entries, a 32-bit count and the word itself */
+struct centry {
+	struct centry *next;
+	uint32_t count;		/* SPILLED once it outgrew 32 bits */
+	char word[];
+};
+
+#define SPILLED UINT32_MAX
+
+struct ctable {
+	struct freq_table base;
+	struct freq_stats st;		/* all but bucket_bytes */
+	struct centry *H[FREQ_NBUCKETS];
+};
+
+/* offset of the 64-bit count of a spilled entry, just after the word */
+static size_t spill_offset(size_t len)
+{
+	size_t off = offsetof(struct centry, word) + len + 1;
+
+	return (off + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1);
+}
+
+/* count of a compact entry, wherever it lives */
+static uint64_t centry_count(const struct centry *ep)
+{
+	if (ep->count != SPILLED)
+		return ep->count;
+
+	return *(const uint64_t *)((const char *)ep +
+			spill_offset(strlen(ep->word)));
+}
+
+/* count an entry into the table's stats, or with dir -1 out of them */
+static void compact_account(struct ctable *ct, struct centry *ep, int dir)
+{
+	size_t len = strlen(ep->word) + 1;
+	size_t size = ep->count != SPILLED ? offsetof(struct centry, word) +
+			len : spill_offset(len - 1) + sizeof(uint64_t);
+	uint64_t d = dir;
+
+	ct->st.entries += d;
+	ct->st.entry_bytes += d * (size - len);
+	ct->st.word_bytes += d * len;
+	ct->st.overhead_bytes += d * freq_malloc_overhead(ep, size);
+}
+
+/* allocate a compact entry for word with count n */
+static struct centry *centry_new(const char *word, uint64_t n)
+{
+	size_t len = strlen(word);
+	size_t size = n < SPILLED ? offsetof(struct centry, word) + len + 1 :
+			spill_offset(len) + sizeof(uint64_t);
+	struct centry *ep;
+
+	if ((ep = malloc(size)) == NULL)
+		err(1, "malloc");
+
+	memcpy(ep->word, word, len + 1);
+
+	if (n < SPILLED) {
+		ep->count = n;
+	} else {
+		ep->count = SPILLED;
+		*(uint64_t *)((char *)ep + spill_offset(len)) = n;
+	}
+
+	return ep;
+}
+
+/* add n to the count for a word in the chain at *epp */
+static void compact_bump(struct ctable *ct, struct centry **epp,
+		const char *word, uint64_t n)
+{
+	struct centry **head = epp;
+	struct centry *ep;
+
+	for (; (ep = *epp) != NULL; epp = &ep->next) {
+		if (strcmp(word, ep->word) != 0)
+			continue;
+
+		/* already in table, bump whichever count it has */
+		if (ep->count != SPILLED && n < SPILLED - ep->count) {
+			ep->count += n;
+		} else if (ep->count == SPILLED) {
+			uint64_t *cp = (uint64_t *)((char *)ep +
+					spill_offset(strlen(ep->word)));
+
+			*cp = freq_sat_add(*cp, n);
+		} else {
+			/* out of 32 bits, move it to a 64-bit count */
+			struct centry *nep = centry_new(word,
+					freq_sat_add(ep->count, n));
+
+			nep->next = ep->next;
+			*epp = nep;
+			compact_account(ct, ep, -1);
+			compact_account(ct, nep, 1);
+			free(ep);
+		}
+		return;
+	}
+
+	/* add it to the front of the linked list */
+	ep = centry_new(word, n);
+	ep->next = *head;
+	*head = ep;
+	compact_account(ct, ep, 1);
+}
+
+/* add n to the count for a word */
+static void compact_add(struct freq_table *t, const char *word, uint64_t n)
+{
+	struct ctable *ct = (struct ctable *)t;
+
+	compact_bump(ct, &ct->H[freq_hash(word)], word, n);
+}
+
+/* move a lookup on to entry ep, or insert its word if there is none */
+static inline enum lstate compact_next(struct lookup *lp, struct centry *ep,
+		struct ctable *ct)
+{
+	if ((lp->ep = ep) == NULL) {
+		ep = centry_new(lp->w->word, lp->w->n);
+		ep->next = ct->H[lp->w->h];
+		ct->H[lp->w->h] = ep;
+		compact_account(ct, ep, 1);
+		return L_IDLE;
+	}
+
+	/* the entry brings the start of its word along */
+	__builtin_prefetch(ep);
+	return L_ENTRY;
+}
+
+/*
+ * add the counts of a batch of words sorted by bucket, a lookup at a
+ * time per chain as vol_count_batch() does; entries that have to spill
+ * are left for the end because other lookups may be walking past them
+ */
+static void compact_count_batch(struct freq_table *t,
+		const struct freq_bword *w, size_t n)
+{
+	struct ctable *ct = (struct ctable *)t;
+	struct centry **H = ct->H;
+	struct lookup l[MAXINFLIGHT] = { { L_IDLE } };	/* L_IDLE, ep NULL */
+	const struct freq_bword *spill[FREQ_BATCH];
+	size_t g = freq_prefetch < MAXINFLIGHT ? freq_prefetch : MAXINFLIGHT;
+	size_t next = 0, busy = 0, nspill = 0;
+
+	if (g == 0) {
+		for (size_t i = 0; i < n; i++)
+			compact_bump(ct, &H[w[i].h], w[i].word, w[i].n);
+		return;
+	}
+
+	while (next < n || busy > 0)
+		for (size_t k = 0; k < g; k++) {
+			struct lookup *lp = &l[k];
+			struct centry *ep = lp->ep;
+
+			switch (lp->state) {
+			case L_IDLE:
+				if (next == n)
+					continue;
+				lp->w = &w[next++];
+				__builtin_prefetch(&H[lp->w->h]);
+				lp->state = L_BUCKET;
+				busy++;
+				continue;
+			case L_BUCKET:
+				lp->state = compact_next(lp, H[lp->w->h], ct);
+				break;
+			case L_ENTRY:
+			case L_WORD:
+				if (strcmp(lp->w->word, ep->word) != 0) {
+					lp->state = compact_next(lp, ep->next,
+							ct);
+					break;
+				}
+				if (ep->count == SPILLED) {
+					uint64_t *cp = (uint64_t *)((char *)ep +
+						spill_offset(strlen(ep->word)));
+
+					*cp = freq_sat_add(*cp, lp->w->n);
+				} else if (lp->w->n < SPILLED - ep->count) {
+					ep->count += lp->w->n;
+				} else {
+					spill[nspill++] = lp->w;
+				}
+				lp->state = L_IDLE;
+				break;
+			}
+
+			if (lp->state == L_IDLE)
+				busy--;
+		}
+
+	for (size_t i = 0; i < nspill; i++)
+		compact_bump(ct, &H[spill[i]->h], spill[i]->word,
+				spill[i]->n);
+}
+
+/* bump the count for a word */
+static void compact_count(struct freq_table *t, const char *word)
+{
+	compact_add(t, word, 1);
+}
+
+/* free every entry counted fewer than min times */
+static uint64_t compact_prune(struct freq_table *t, uint64_t min)
+{
+	struct ctable *ct = (struct ctable *)t;
+	struct centry **epp, *ep;
+	uint64_t removed = 0;
+
+	for (int i = 0; i < FREQ_NBUCKETS; i++)
+		for (epp = &ct->H[i]; (ep = *epp) != NULL; ) {
+			if (centry_count(ep) >= min) {
+				epp = &ep->next;
+				continue;
+			}
+			*epp = ep->next;
+			compact_account(ct, ep, -1);
+			free(ep);
+			removed++;
+		}
+
+	return removed;
+}
+
+static uint64_t compact_size(struct freq_table *t)
+{
+	return ((struct ctable *)t)->st.entries;
+}
+
+static void compact_stats(struct freq_table *t, struct freq_stats *st)
+{
+	struct ctable *ct = (struct ctable *)t;
+
+	*st = ct->st;
+	st->bucket_bytes = sizeof(ct->H);
+}
+
+/* call fn for every entry in the table */
+static void compact_walk(struct freq_table *t, freq_walk_fn fn, void *arg)
+{
+	struct centry **H = ((struct ctable *)t)->H;
+	struct centry *ep;
+
+	for (int i = 0; i < FREQ_NBUCKETS; i++)
+		for (ep = H[i]; ep != NULL; ep = ep->next)
+			fn(ep->word, centry_count(ep), arg);
+}
+
+/* free every entry and the table itself */
+static void compact_close(struct freq_table *t)
+{
+	struct centry **H = ((struct ctable *)t)->H;
+	struct centry *ep, *next;
+
+	for (int i = 0; i < FREQ_NBUCKETS; i++)
+		for (ep = H[i]; ep != NULL; ep = next) {
+			next = ep->next;
+			free(ep);
+		}
+
+	free(t);
+}
+
+static const struct freq_ops compact_ops = {
+	.name = "volatile-compact",
+	.count = compact_count,
+	.add = compact_add,
+	.count_batch = compact_count_batch,
+	.prune = compact_prune,
+	.size = compact_size,
+	.stats = compact_stats,
+	.walk = compact_walk,
+	.close = compact_close,
+};
+
+/* single-threaded table in DRAM */
+struct freq_table *freq_volatile_create(int flags)
+{
+	if (flags & FREQ_COMPACT) {
+		struct ctable *ct;
+
+		if ((ct = calloc(1, sizeof(*ct))) == NULL)
+			err(1, "calloc");
+
+		ct->base.ops = &compact_ops;
+		return &ct->base;
+	}
+
+	struct vtable *vt;
+
+	if ((vt = calloc(1, sizeof(*vt))) == NULL)
+		err(1, "calloc");
+
+	vt->base.ops = &vol_ops;
+	return &vt->base;
+}
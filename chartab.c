@@ -0,0 +1,42 @@
+/*
+ * chartab.c -- character classification and case folding tables
+ *
+ * the tokenizer classifies each byte with a single lookup in these
+ * tables instead of calling isalpha(), so results are the same whatever
+ * the process locale is.  The tables are expanded by the preprocessor
+ * from the CLASS() and FOLD() expressions below, chartab.hpp generates
+ * the same tables with constexpr for the C++ path.
+ */
+#include "libfreq.h"
+
+/* ISO 8859-1 letters: ª µ º and 0xc0-0xff except × and ÷ */
+#define LATIN1(c) \
+	((c) == 0xaa || (c) == 0xb5 || (c) == 0xba || \
+	((c) >= 0xc0 && (c) != 0xd7 && (c) != 0xf7))
+
+/* ISO 8859-1 upper case letters, 0x20 below their lower case forms */
+#define LATIN1_UPPER(c) ((c) >= 0xc0 && (c) <= 0xde && (c) != 0xd7)
+
+#define CLASS(c) \
+	((((c) >= 'A' && (c) <= 'Z') || ((c) >= 'a' && (c) <= 'z')) ? \
+		FREQ_C_ALPHA : \
+	((c) >= '0' && (c) <= '9') ? FREQ_C_DIGIT : \
+	((c) == '\'') ? FREQ_C_APOS : \
+	LATIN1(c) ? FREQ_C_LATIN1 : 0)
+
+#define FOLD(c) \
+	((((c) >= 'A' && (c) <= 'Z') || LATIN1_UPPER(c)) ? (c) + 0x20 : (c))
+
+/* expand F over 4, 16, 64 and 256 consecutive byte values */
+#define R4(F, n)	F(n), F((n) + 1), F((n) + 2), F((n) + 3)
+#define R16(F, n)	R4(F, n), R4(F, (n) + 4), R4(F, (n) + 8), \
+			R4(F, (n) + 12)
+#define R64(F, n)	R16(F, n), R16(F, (n) + 16), R16(F, (n) + 32), \
+			R16(F, (n) + 48)
+#define R256(F)		R64(F, 0), R64(F, 64), R64(F, 128), R64(F, 192)
+
+/* class bits for each byte, independent of the process locale */
+const unsigned char freq_ctype[256] = { R256(CLASS) };
+
+/* each byte mapped to its lower case equivalent, ASCII and ISO 8859-1 */
+const unsigned char freq_fold[256] = { R256(FOLD) };
@@ -0,0 +1,169 @@
+/*
+ * chartab.hpp -- constexpr character tables and tokenizer for C++
+ *
+ * the same classification and case folding tables chartab.c builds with
+ * the preprocessor, generated here by constexpr functions so they exist
+ * at compile time, plus a tokenizer templated on the profile so the
+ * per-byte test is one lookup and one constant mask.
+ */
+#ifndef CHARTAB_HPP
+#define CHARTAB_HPP 1
+
+#include <err.h>
+#include <stdio.h>
+
+#include "libfreq.h"
+
+namespace libfreq {
+
+/* a 256-entry byte table usable in constant expressions */
+struct chartab {
+	unsigned char v[256];
+
+	constexpr unsigned char operator[](unsigned char c) const
+	{
+		return v[c];
+	}
+};
+
+/* ISO 8859-1 letters: ª µ º and 0xc0-0xff except × and ÷ */
+constexpr bool latin1_letter(unsigned c)
+{
+	return c == 0xaa || c == 0xb5 || c == 0xba ||
+	    (c >= 0xc0 && c != 0xd7 && c != 0xf7);
+}
+
+/* class bits for one byte, same as CLASS() in chartab.c */
+constexpr unsigned char char_class(unsigned c)
+{
+	return ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z')) ?
+		FREQ_C_ALPHA :
+	    (c >= '0' && c <= '9') ? FREQ_C_DIGIT :
+	    (c == '\'') ? FREQ_C_APOS :
+	    latin1_letter(c) ? FREQ_C_LATIN1 : 0;
+}
+
+/* lower case equivalent of one byte, same as FOLD() in chartab.c */
+constexpr unsigned char char_fold(unsigned c)
+{
+	return ((c >= 'A' && c <= 'Z') ||
+	    (c >= 0xc0 && c <= 0xde && c != 0xd7)) ? c + 0x20 : c;
+}
+
+/* build a table by applying f to every byte value */
+constexpr chartab make_chartab(unsigned char (*f)(unsigned))
+{
+	chartab t{};
+
+	for (unsigned c = 0; c < 256; c++)
+		t.v[c] = f(c);
+
+	return t;
+}
+
+constexpr chartab ctype_table = make_chartab(char_class);
+constexpr chartab fold_table = make_chartab(char_fold);
+
+static_assert(ctype_table['q'] == FREQ_C_ALPHA, "bad ctype table");
+static_assert(ctype_table['7'] == FREQ_C_DIGIT, "bad ctype table");
+static_assert(ctype_table['-'] == 0, "bad ctype table");
+static_assert(ctype_table[0xe9] == FREQ_C_LATIN1, "bad ctype table");
+static_assert(fold_table['Q'] == 'q', "bad fold table");
+static_assert(fold_table[0xc9] == 0xe9, "bad fold table");
+
+/*
+ * break a text file into words and call fn(word) on each one, folding
+ * them to lower case if FOLD is set
+ */
+template <unsigned PROFILE, bool FOLD, class F>
+void tokenize_file(const char *fname, F fn)
+{
+	FILE *fp;
+	int c;
+	char word[FREQ_MAXWORD];
+	char *ptr;
+
+	if ((fp = fopen(fname, "r")) == NULL)
+		err(1, "fopen: %s", fname);
+
+	ptr = NULL;
+	while ((c = getc(fp)) != EOF)
+		if (ctype_table[c] & PROFILE) {
+			if (FOLD)
+				c = fold_table[c];
+			if (ptr == NULL) {
+				/* starting a new word */
+				ptr = word;
+				*ptr++ = c;
+			} else if (ptr < &word[FREQ_MAXWORD - 1])
+				/* add character to current word */
+				*ptr++ = c;
+			else {
+				/* word too long, truncate it */
+				*ptr++ = '\0';
+				fn(word);
+				ptr = NULL;
+			}
+		} else if (ptr != NULL) {
+			/* word ended, store it */
+			*ptr++ = '\0';
+			fn(word);
+			ptr = NULL;
+		}
+
+	/* handle the last word */
+	if (ptr != NULL) {
+		/* word ended, store it */
+		*ptr++ = '\0';
+		fn(word);
+	}
+
+	fclose(fp);
+}
+
+/* tokenize_file() with the profile picked at run time */
+template <bool FOLD, class F>
+void tokenize_file(const char *fname, enum freq_profile profile, F fn)
+{
+	switch (profile) {
+	case FREQ_PROFILE_ALPHA:
+		tokenize_file<FREQ_PROFILE_ALPHA, FOLD>(fname, fn);
+		break;
+	case FREQ_PROFILE_ALNUM:
+		tokenize_file<FREQ_PROFILE_ALNUM, FOLD>(fname, fn);
+		break;
+	case FREQ_PROFILE_WORD:
+		tokenize_file<FREQ_PROFILE_WORD, FOLD>(fname, fn);
+		break;
+	case FREQ_PROFILE_LATIN1:
+		tokenize_file<FREQ_PROFILE_LATIN1, FOLD>(fname, fn);
+		break;
+	}
+}
+
+/* freq_word_fn trampoline into a C++ callable */
+template <class F>
+void call_word_fn(const char *word, void *arg)
+{
+	(*static_cast<F *>(arg))(word);
+}
+
+/*
+ * tokenize_file() with all the tokenizer options picked at run time,
+ * UTF-8 input and stopword files go through the C tokenizer in libfreq
+ */
+template <class F>
+void tokenize_file(const char *fname, const struct freq_tokopts &opts,
+		F fn)
+{
+	if (opts.utf8 || opts.stopwords != NULL)
+		freq_tokenize_file(fname, &opts, call_word_fn<F>, &fn);
+	else if (opts.fold)
+		tokenize_file<true>(fname, opts.profile, fn);
+	else
+		tokenize_file<false>(fname, opts.profile, fn);
+}
+
+} /* namespace libfreq */
+
+#endif
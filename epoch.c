@@ -0,0 +1,176 @@
+/*
+ * epoch.c -- epoch-based reclamation
+ *
+ * the global epoch only moves from e to e + 1 once every thread inside
+ * a critical section has seen e.  Something retired in epoch e was
+ * unlinked before it was retired, so only sections that started in e
+ * or before can hold it, and once the epoch reaches e + 2 they are all
+ * gone.  Retiring is rare (pruning, resizing), so the limbo lists are
+ * global, under a lock word; entering and leaving a section only touch
+ * the calling thread's own record.
+ */
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libfreq.h"
+#include "epoch.h"
+#include "lockword.h"
+
+/* a thread's record, on a cache line of its own */
+struct rec {
+	uint64_t epoch;		/* epoch seen on entering, 0 outside */
+	unsigned nest;		/* depth of nested sections */
+	int inuse;		/* claimed by a live thread */
+	struct rec *next;
+} __attribute__((aligned(FREQ_CACHELINE)));
+
+/* something waiting to be freed */
+struct retired {
+	struct retired *next;
+	void *p;
+	void (*fn)(void *);
+};
+
+static uint64_t Epoch = 1;		/* 0 means outside a section */
+static uint32_t Lock;			/* protects everything below */
+static struct rec *Recs;		/* every record ever made */
+static struct retired *Limbo[3];	/* retired in epoch e, at e % 3 */
+
+static __thread struct rec *My;
+static pthread_key_t Key;
+static pthread_once_t Once = PTHREAD_ONCE_INIT;
+
+/* thread exit, leave the record for the next thread to claim */
+static void release(void *arg)
+{
+	struct rec *r = arg;
+
+	__atomic_store_n(&r->inuse, 0, __ATOMIC_RELEASE);
+}
+
+static void init(void)
+{
+	if ((errno = pthread_key_create(&Key, release)) != 0)
+		err(1, "pthread_key_create");
+}
+
+/* this thread's record, claimed or made on its first section */
+static struct rec *myrec(void)
+{
+	struct rec *r;
+
+	if (My != NULL)
+		return My;
+
+	pthread_once(&Once, init);
+
+	freq_lock(&Lock);
+
+	for (r = Recs; r != NULL; r = r->next)
+		if (!__atomic_load_n(&r->inuse, __ATOMIC_ACQUIRE))
+			break;
+
+	if (r == NULL) {
+		if ((errno = posix_memalign((void **)&r, FREQ_CACHELINE,
+				sizeof(*r))) != 0)
+			err(1, "posix_memalign");
+		memset(r, 0, sizeof(*r));
+		r->next = Recs;
+		Recs = r;
+	}
+
+	r->inuse = 1;
+	freq_unlock(&Lock);
+
+	if ((errno = pthread_setspecific(Key, r)) != 0)
+		err(1, "pthread_setspecific");
+
+	return My = r;
+}
+
+void freq_epoch_enter(void)
+{
+	struct rec *r = myrec();
+
+	if (r->nest++ != 0)
+		return;
+
+	/* announce the epoch before looking at anything shared */
+	__atomic_store_n(&r->epoch, __atomic_load_n(&Epoch, __ATOMIC_RELAXED),
+			__ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void freq_epoch_exit(void)
+{
+	struct rec *r = My;
+
+	if (--r->nest == 0)
+		__atomic_store_n(&r->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * move the epoch on if every thread in a section has seen it, and free
+ * what that makes safe; needs Lock
+ */
+static void advance(void)
+{
+	uint64_t e = Epoch;
+	struct retired *rp, *next;
+
+	for (struct rec *r = Recs; r != NULL; r = r->next) {
+		uint64_t re = __atomic_load_n(&r->epoch, __ATOMIC_SEQ_CST);
+
+		if (re != 0 && re != e)
+			return;
+	}
+
+	__atomic_store_n(&Epoch, e + 1, __ATOMIC_SEQ_CST);
+
+	/* what was retired in e - 1 is out of every section now */
+	rp = Limbo[(e + 2) % 3];
+	Limbo[(e + 2) % 3] = NULL;
+
+	for (; rp != NULL; rp = next) {
+		next = rp->next;
+		rp->fn(rp->p);
+		free(rp);
+	}
+}
+
+void freq_epoch_retire(void *p, void (*fn)(void *))
+{
+	struct retired *rp;
+
+	if ((rp = malloc(sizeof(*rp))) == NULL)
+		err(1, "malloc");
+	rp->p = p;
+	rp->fn = fn;
+
+	freq_lock(&Lock);
+	rp->next = Limbo[Epoch % 3];
+	Limbo[Epoch % 3] = rp;
+	advance();
+	freq_unlock(&Lock);
+}
+
+void freq_epoch_barrier(void)
+{
+	for (;;) {
+		freq_lock(&Lock);
+		advance();
+		int empty = !Limbo[0] && !Limbo[1] && !Limbo[2];
+		freq_unlock(&Lock);
+
+		if (empty)
+			return;
+
+		/* someone is still in a section, give them a chance to leave */
+		sched_yield();
+	}
+}
@@ -0,0 +1,26 @@
+/*
+ * epoch.h -- epoch-based reclamation for the concurrent tables
+ *
+ * readers bracket every access to shared structures with
+ * freq_epoch_enter() and freq_epoch_exit(), which only store to a
+ * per-thread record.  Writers that unlink something hand it to
+ * freq_epoch_retire() instead of freeing it; it is freed once every
+ * thread that might still be looking at it has left its critical
+ * section, that is, two epochs later.
+ */
+#ifndef EPOCH_H
+#define EPOCH_H 1
+
+/* start a read-side critical section, they nest */
+void freq_epoch_enter(void);
+
+/* end a read-side critical section */
+void freq_epoch_exit(void);
+
+/* call fn(p) once no critical section can still be looking at p */
+void freq_epoch_retire(void *p, void (*fn)(void *));
+
+/* wait for everything retired so far to be freed, outside any section */
+void freq_epoch_barrier(void);
+
+#endif
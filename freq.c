@@ -1,149 +1,107 @@
 /*
  * freq.c -- simple word frequency counter
  */
-#include <ctype.h>
-#include <err.h>
-#include <stdarg.h>
+#include <getopt.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <string.h>
 #include <unistd.h>
 
-#define NBUCKETS 10007
+#include "libfreq.h"
 
-/* entries in a bucket are a linked list of struct entry */
-struct entry {
-	struct entry *next;
-	const char *word;
-	int count;
-};
-
-/* each bucket contains a pointer to the linked list of entries */
-struct bucket {
-	struct entry *entries;
-} H[NBUCKETS];
+/* options with no short form */
+enum { OPT_STATS = 256 };
 
+static const struct option longopts[] = {
+	FREQ_TOKOPTS_LONG,
+	{ "max-entries", required_argument, NULL, 'l' },
+	{ "max-memory", required_argument, NULL, 'm' },
+	{ "spill", required_argument, NULL, 'D' },
+	{ "stats", no_argument, NULL, OPT_STATS },
+	{ NULL, 0, NULL, 0 }
+};
 
-/* hash a string into an index into H[] */
-unsigned hash(const char *s)
+void usage(const char *cmd)
 {
-	unsigned h = NBUCKETS ^ ((unsigned)*s++ << 2);
-	unsigned len = 0;
-
-	while (*s) {
-		len++;
-		h ^= (((unsigned)*s) << (len % 3)) +
-		    ((unsigned)*(s - 1) << ((len % 3 + 7)));
-		s++;
-	}
-	h ^= len;
-
-	return h % NBUCKETS;
+	fprintf(stderr,
+		"usage: %s [-cp] [-l|--max-entries n] [-m|--max-memory size] "
+		"[-D|--spill dir] [--stats] " FREQ_TOKOPTS_USAGE
+		" wordfiles...\n",
+		cmd);
+	exit(1);
 }
 
-/* bump the count for a word */
-void count(const char *word)
+int main(int argc, char *argv[])
 {
-	unsigned h = hash(word);
-	struct entry *ep = H[h].entries;
-
-	for (; ep != NULL; ep = ep->next)
-		if (strcmp(word, ep->word) == 0) {
-			/* already in table, just bump the count */
-			ep->count++;
-			return;
-		}
-
-	/* allocate new entry in table */
-	if ((ep = calloc(1, sizeof(*ep))) == NULL)
-		err(1, "calloc");
-
-	if ((ep->word = strdup(word)) == NULL)
-		err(1, "strdup");
-
-	ep->count = 1;
+	int pflag = 0;
+	int flags = 0;		/* freq_volatile_create(flags) flags */
+	int sflag = 0;
+	uint64_t max = 0;	/* entries to prune down to, 0 for all */
+	uint64_t maxmem = 0;	/* likewise, bytes */
+	const char *spill = NULL;	/* where to spill instead of pruning */
+	struct freq_tokopts opts = { .profile = FREQ_PROFILE_ALPHA };
+	int c;
 
-	/* add it to the front of the linked list */
-	ep->next = H[h].entries;
-	H[h].entries = ep;
-}
+	while ((c = getopt_long(argc, argv, "cD:l:m:p" FREQ_TOKOPTS, longopts,
+			NULL)) != -1)
+		switch (c) {
+		case 'c':
+			flags |= FREQ_COMPACT;
+			break;
+		case 'D':
+			spill = optarg;
+			break;
+		case 'l':
+			if (freq_parse_count(optarg, &max) < 0 || max == 0)
+				usage(argv[0]);
+			break;
+		case 'm':
+			if (freq_parse_size(optarg, &maxmem) < 0 || maxmem == 0)
+				usage(argv[0]);
+			break;
+		case 'p':
+			pflag++;
+			break;
+		case OPT_STATS:
+			sflag++;
+			break;
+		default:
+			if (freq_tokopt(&opts, c, optarg) < 0)
+				usage(argv[0]);
+		}
 
-#define MAXWORD 8192
+	freq_tokopts_setup(&opts);
 
-/* break a test file into words and call count() on each one */
-void count_all_words(const char *fname)
-{
-	FILE *fp;
-	int c;
-	char word[MAXWORD];
-	char *ptr;
-
-	if ((fp = fopen(fname, "r")) == NULL)
-		err(1, "fopen: %s", fname);
-
-	ptr = NULL;
-	while ((c = getc(fp)) != EOF)
-		if (isalpha(c)) {
-			if (ptr == NULL) {
-				/* starting a new word */
-				ptr = word;
-				*ptr++ = c;
-			} else if (ptr < &word[MAXWORD - 1])
-				/* add character to current word */
-				*ptr++ = c;
-			else {
-				/* word too long, truncate it */
-				*ptr++ = '\0';
-				count(word);
-				ptr = NULL;
-			}
-		} else if (ptr != NULL) {
-			/* word ended, store it */
-			*ptr++ = '\0';
-			count(word);
-			ptr = NULL;
-		}
+	int arg = optind;	/* index into argv[] for first file name */
 
-	/* handle the last word */
-	if (ptr != NULL) {
-		/* word ended, store it */
-		*ptr++ = '\0';
-		count(word);
-	}
+	if (argv[arg] == NULL || (spill != NULL && max == 0 && maxmem == 0))
+		usage(argv[0]);
 
-	fclose(fp);
-}
+	struct freq_table *t = freq_volatile_create(flags);
 
-/* print all entries in the hash table */
-void print_counts()
-{
-	struct entry *ep;
+	freq_set_max_entries(t, max);
+	freq_set_max_memory(t, maxmem);
+	if (spill != NULL)
+		freq_set_spill(t, spill, 0);
 
-	for (int i = 0; i < NBUCKETS; i++)
-		for (ep = H[i].entries; ep != NULL; ep = ep->next)
-			printf("%d %s\n", ep->count, ep->word);
-}
+	for (; arg < argc; arg++)
+		freq_count_file(t, argv[arg], &opts);
 
-int main(int argc, char *argv[])
-{
-	int pflag = 0;
-	int arg = 1;	/* index into argv[] for first file name */
+	if (pflag)
+		freq_print(t);
 
-	if (argc > 1 && strcmp(argv[1], "-p") == 0) {
-		pflag++;
-		arg++;
-	}
+	if (sflag) {
+		struct freq_stats st;
 
-	if (argv[arg] == NULL) {
-		fprintf(stderr, "usage: %s [-p] wordfiles...\n", argv[0]);
-		exit(1);
+		freq_stats(t, &st);
+		freq_print_stats(argv[0], &st);
 	}
 
-	for (; arg < argc; arg++)
-		count_all_words(argv[arg]);
-
-	if (pflag)
-		print_counts();
+	if (freq_error(t) != 0)
+		fprintf(stderr, "%s: pruned %" PRIu64 " entries, counts may be "
+				"up to %" PRIu64 " short\n", argv[0], t->pruned,
+				freq_error(t));
 
+	freq_close(t);
 	exit(0);
 }
@@ -0,0 +1,194 @@
+/*
+ * freq_bench.c -- time counting with and without prefetching
+ *
+ * counts a stream of words drawn uniformly at random from a vocabulary
+ * of random words, once a word at a time through freq_count() and then
+ * in batches through freq_count_batch() at each prefetch distance.  The
+ * vocabulary should make the table bigger than the last level cache for
+ * the prefetches to have misses to hide.
+ *
+ * with -m -t N the concurrent table is counted into by N threads at
+ * once, each taking its own slice of the stream.
+ */
+#include <err.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libfreq.h"
+
+static uint64_t Seed = 88172645463325252ULL;
+
+/* xorshift64, the same stream on every run */
+static uint64_t rnd(void)
+{
+	Seed ^= Seed << 13;
+	Seed ^= Seed >> 7;
+	Seed ^= Seed << 17;
+	return Seed;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int Flags;		/* freq_volatile_create() flags */
+static int Concurrent;		/* time the concurrent table instead */
+
+static struct freq_table *create(void)
+{
+	return Concurrent ? freq_concurrent_create() :
+			freq_volatile_create(Flags);
+}
+
+static int Nthreads = 1;	/* threads counting at once, with -m */
+
+/* one thread's slice of the stream */
+struct slice {
+	struct freq_table *t;
+	const char **words;
+	const size_t *lens;
+	size_t n;
+	int batch;
+};
+
+static void *count_slice(void *arg)
+{
+	struct slice *sp = arg;
+
+	if (sp->batch)
+		freq_count_batch(sp->t, sp->words, sp->lens, sp->n);
+	else
+		for (size_t i = 0; i < sp->n; i++)
+			freq_count(sp->t, sp->words[i]);
+
+	return NULL;
+}
+
+/* ns per word to count all nwords words, one at a time or in batches */
+static double run(const char **words, const size_t *lens, size_t nwords,
+		int batch)
+{
+	struct freq_table *t = create();
+	struct slice slices[Nthreads];
+	pthread_t tids[Nthreads];
+	double start = now();
+
+	for (int i = 0; i < Nthreads; i++) {
+		size_t from = nwords * i / Nthreads;
+
+		slices[i].t = t;
+		slices[i].words = words + from;
+		slices[i].lens = lens + from;
+		slices[i].n = nwords * (i + 1) / Nthreads - from;
+		slices[i].batch = batch;
+		if ((errno = pthread_create(&tids[i], NULL, count_slice,
+				&slices[i])) != 0)
+			err(1, "pthread_create %d of %d", i, Nthreads);
+	}
+
+	for (int i = 0; i < Nthreads; i++)
+		pthread_join(tids[i], NULL);
+
+	double ns = (now() - start) * 1e9 / nwords;
+
+	freq_close(t);
+	return ns;
+}
+
+void usage(const char *cmd)
+{
+	fprintf(stderr, "usage: %s [-c|-m [-t threads]] [-n distinct] "
+			"[-w words] [-d distance,...]\n", cmd);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	size_t ndistinct = 100000;
+	size_t nwords = 2000000;
+	char *dists = strdup("0,1,2,4,8,16");
+	int c;
+
+	while ((c = getopt(argc, argv, "cd:mn:t:w:")) != -1)
+		switch (c) {
+		case 'c':
+			Flags |= FREQ_COMPACT;
+			break;
+		case 'd':
+			dists = optarg;
+			break;
+		case 'm':
+			Concurrent++;
+			break;
+		case 'n':
+			ndistinct = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			Nthreads = atoi(optarg);
+			break;
+		case 'w':
+			nwords = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+
+	if (ndistinct == 0 || nwords == 0 || optind != argc || Nthreads < 1 ||
+	    (Nthreads > 1 && !Concurrent))
+		usage(argv[0]);
+
+	/* the vocabulary, 4 to 12 random letters per word */
+	char **vocab = malloc(ndistinct * sizeof(*vocab));
+	const char **words = malloc(nwords * sizeof(*words));
+	size_t *lens = malloc(nwords * sizeof(*lens));
+
+	if (vocab == NULL || words == NULL || lens == NULL)
+		err(1, "malloc");
+
+	for (size_t i = 0; i < ndistinct; i++) {
+		size_t len = 4 + rnd() % 9;
+
+		if ((vocab[i] = malloc(len + 1)) == NULL)
+			err(1, "malloc");
+		for (size_t j = 0; j < len; j++)
+			vocab[i][j] = 'a' + rnd() % 26;
+		vocab[i][len] = '\0';
+	}
+
+	for (size_t i = 0; i < nwords; i++) {
+		words[i] = vocab[rnd() % ndistinct];
+		lens[i] = strlen(words[i]);
+	}
+
+	printf("%s table, %d thread%s, %zu distinct words, %zu words, "
+			"LLC %ld bytes\n", Concurrent ? "concurrent" :
+			Flags & FREQ_COMPACT ? "compact" : "volatile",
+			Nthreads, Nthreads == 1 ? "" : "s", ndistinct, nwords,
+			sysconf(_SC_LEVEL3_CACHE_SIZE));
+	printf("freq_count            %8.1f ns/word\n",
+			run(words, lens, nwords, 0));
+
+	for (char *d = strtok(dists, ","); d != NULL; d = strtok(NULL, ",")) {
+		freq_prefetch = atoi(d);
+		printf("freq_count_batch d=%-3u %8.1f ns/word\n", freq_prefetch,
+				run(words, lens, nwords, 1));
+	}
+
+	for (size_t i = 0; i < ndistinct; i++)
+		free(vocab[i]);
+	free(vocab);
+	free(words);
+	free(lens);
+	exit(0);
+}
@@ -0,0 +1,136 @@
+/*
+ * freq_cpp.cpp -- word frequency counter built on the WordCounter template
+ *
+ * with -t each file is counted by its own thread into a lock-free table,
+ * otherwise the files are counted one after another into a table with no
+ * locking at all.  Both are specializations of the same template.
+ *
+ * -S checks words against the compile-time perfect hash of the built-in
+ * stopwords in stopwords.hpp.
+ */
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <unistd.h>
+
+#include <functional>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "chartab.hpp"
+#include "libfreq.h"
+#include "stopwords.hpp"
+#include "wordcounter.hpp"
+
+using libfreq::WordCounter;
+using libfreq::ClassicHash;
+using libfreq::FnvHash;
+using libfreq::Chained;
+using libfreq::NoLock;
+using libfreq::AtomicLock;
+using libfreq::tokenize_file;
+using libfreq::builtin_stopwords;
+
+typedef WordCounter<ClassicHash, Chained<>, NoLock, uint64_t> serial_counter;
+typedef WordCounter<FnvHash, Chained<>, AtomicLock, uint64_t> mt_counter;
+
+static int Sflag;	/* drop the built-in stopwords */
+
+/* count every word in one file */
+template <class Counter>
+static void count_file(Counter *wc, const char *fname,
+		const struct freq_tokopts &opts)
+{
+	if (Sflag)
+		tokenize_file(fname, opts, [wc](const char *word) {
+			if (!builtin_stopwords.contains(word))
+				wc->count(word);
+		});
+	else
+		tokenize_file(fname, opts,
+			[wc](const char *word) { wc->count(word); });
+}
+
+/* print all entries in the table */
+template <class Counter>
+static void print_counts(Counter &wc)
+{
+	wc.walk([](const char *word, typename Counter::count_type count) {
+		std::cout << count << ' ' << word << '\n';
+	});
+}
+
+static const struct option longopts[] = {
+	FREQ_TOKOPTS_LONG,
+	{ NULL, 0, NULL, 0 }
+};
+
+static void usage(const char *cmd)
+{
+	std::cerr << "usage: " << cmd
+		  << " [-p] [-t] " FREQ_TOKOPTS_USAGE " wordfiles..."
+		  << std::endl;
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	int pflag = 0;
+	int tflag = 0;
+	struct freq_tokopts opts = { FREQ_PROFILE_ALPHA, 0, 0, NULL, 0, NULL };
+	int c;
+
+	while ((c = getopt_long(argc, argv, "pt" FREQ_TOKOPTS, longopts,
+			NULL)) != -1)
+		switch (c) {
+		case 'p':
+			pflag++;
+			break;
+		case 't':
+			tflag++;
+			break;
+		case 'S':
+			Sflag++;
+			break;
+		default:
+			if (freq_tokopt(&opts, c, optarg) < 0)
+				usage(argv[0]);
+		}
+
+	freq_tokopts_setup(&opts);
+
+	int arg = optind;	/* index into argv[] for first file name */
+
+	if (arg >= argc)
+		usage(argv[0]);
+
+	if (tflag) {
+		mt_counter *wc = new mt_counter;
+		std::vector<std::thread> threads;
+
+		for (; arg < argc; arg++)
+			threads.emplace_back(count_file<mt_counter>, wc,
+					argv[arg], std::cref(opts));
+
+		for (auto &t : threads)
+			t.join();
+
+		if (pflag)
+			print_counts(*wc);
+		delete wc;
+	} else {
+		serial_counter *wc = new serial_counter;
+
+		for (; arg < argc; arg++)
+			count_file(wc, argv[arg], opts);
+
+		if (pflag)
+			print_counts(*wc);
+		delete wc;
+	}
+
+	exit(0);
+}
@@ -1,180 +1,641 @@
 /*
  * freq_mt.c -- multi-threaded word frequency counter
+ *
+ * by default one thread per file counts straight into one shared table.
+ * With -n the table is split by hash into a shard per NUMA node, each
+ * allocated on its node: file threads only tokenize, and hand words in
+ * batches to the workers of the node that owns them.
+ *
+ * With -r the table is split into shards that share nothing: each shard
+ * is a private single-threaded table owned by one thread, fed batches
+ * through a single-producer single-consumer ring from every file thread,
+ * so counting takes no locks at all.  An owner with nothing to drain, or
+ * a file thread whose ring is full, spins a little and then sleeps until
+ * the other side wakes it.
+ *
+ * with -l the table, or every shard its share, is kept to about that
+ * many entries by pruning the lowest counts, see freq_set_max_entries();
+ * -m does the same for the memory --stats reports.  With -r and -D, a
+ * shard over its limits is written to a run file in a directory instead,
+ * and the runs are merged at the end.
  */
-#include <ctype.h>
+#define _GNU_SOURCE
 #include <err.h>
 #include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <numa.h>
 #include <pthread.h>
-#include <stdarg.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
-#define NBUCKETS 10007
+#include "libfreq.h"
+#include "lockword.h"
 
-/* entries in a bucket are a linked list of struct entry */
-struct entry {
-	struct entry *next;
-	const char *word;
-	pthread_mutex_t mutex;		/* protects count field */
-	int count;
+struct freq_table *T;		/* table shared by all threads */
+struct freq_tokopts Opts = { .profile = FREQ_PROFILE_ALPHA };
+uint64_t MaxEntries;		/* entries to prune down to, 0 for all */
+uint64_t MaxMemory;		/* likewise, bytes */
+const char *Spill;		/* where -r shards spill instead of pruning */
+
+/* thread start routine, count all the words in one file */
+void *count_all_words(void *arg)
+{
+	freq_count_file(T, (const char *)arg, &Opts);
+	return NULL;
+}
+
+/* words are handed to the shard that owns them this many bytes at a time */
+#define BATCHSIZE 65536
+
+/* a batch of NUL-terminated words, back to back */
+struct batch {
+	struct batch *next;
+	size_t used;		/* bytes of buf in use */
+	char buf[BATCHSIZE];
 };
 
-/* each bucket contains a pointer to the linked list of entries */
-struct bucket {
-	pthread_rwlock_t rwlock;	/* protects entries field */
-	struct entry *entries;
-} H[NBUCKETS];
+/* the part of the table, and the workers, on one NUMA node */
+struct shard {
+	int node;
+	cpu_set_t cpus;			/* CPUs on the node */
+	struct freq_table *table;
+	pthread_mutex_t lock;		/* protects the fields below */
+	pthread_cond_t cond;		/* signalled on push and on done */
+	struct batch *head, *tail;	/* batches waiting to be counted */
+	int done;			/* no more batches are coming */
+	uint32_t work;			/* event word, rings have batches */
+} __attribute__((aligned(FREQ_CACHELINE)));
+
+/* batches in flight from one file thread to one shard owner (-r) */
+#define RINGSIZE 64
 
+/*
+ * single-producer single-consumer ring: only the file thread writes tail
+ * and done, only the owner writes head, each on its own cache line; room
+ * is only written by the file thread when the ring is full
+ */
+struct ring {
+	struct batch *slots[RINGSIZE];
+	unsigned long tail;		/* next slot to fill */
+	int done;			/* file thread pushed its last batch */
+	char pad1[FREQ_CACHELINE];
+	unsigned long head;		/* next slot to drain */
+	uint32_t room;			/* event word, head has moved */
+	char pad2[FREQ_CACHELINE];
+};
+
+struct shard *Shards;
+int Nshards;
+struct ring *Rings;	/* Rings[file * Nshards + shard] with -r */
+int Numa;		/* the system supports NUMA policies */
+int Pin;		/* pin threads to CPUs (-P) */
 
-/* hash a string into an index into H[] */
-unsigned hash(const char *s)
+/* calloc() for arrays of structs that start on a cache line */
+static void *calloc_lines(size_t n, size_t size)
 {
-	unsigned h = NBUCKETS ^ ((unsigned)*s++ << 2);
-	unsigned len = 0;
+	void *p;
 
-	while (*s) {
-		len++;
-		h ^= (((unsigned)*s) << (len % 3)) +
-		    ((unsigned)*(s - 1) << ((len % 3 + 7)));
-		s++;
-	}
-	h ^= len;
+	if ((errno = posix_memalign(&p, FREQ_CACHELINE, n * size)) != 0)
+		err(1, "posix_memalign");
 
-	return h % NBUCKETS;
+	return memset(p, 0, n * size);
 }
 
-/* bump the count for a word */
-void count(const char *word)
+/* shard owning a word */
+static inline struct shard *word_shard(const char *word)
 {
-	unsigned h = hash(word);
+	return &Shards[(unsigned long)freq_hash(word) * Nshards /
+			FREQ_NBUCKETS];
+}
 
-	/* start with the read lock on the bucket */
-	pthread_rwlock_rdlock(&H[h].rwlock);
+static void shard_push(struct shard *s, struct batch *b)
+{
+	b->next = NULL;
+
+	pthread_mutex_lock(&s->lock);
+	if (s->tail == NULL)
+		s->head = b;
+	else
+		s->tail->next = b;
+	s->tail = b;
+	pthread_cond_signal(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+}
 
-	struct entry *ep = H[h].entries;
+/* next batch for a shard, NULL once it is done and drained */
+static struct batch *shard_pop(struct shard *s)
+{
+	struct batch *b;
 
-	for (; ep != NULL; ep = ep->next)
-		if (strcmp(word, ep->word) == 0) {
-			/* already in table, just bump the count */
+	pthread_mutex_lock(&s->lock);
+	while (s->head == NULL && !s->done)
+		pthread_cond_wait(&s->cond, &s->lock);
+	if ((b = s->head) != NULL && (s->head = b->next) == NULL)
+		s->tail = NULL;
+	pthread_mutex_unlock(&s->lock);
 
-			/* drop bucket lock */
-			pthread_rwlock_unlock(&H[h].rwlock);
+	return b;
+}
 
-			/* lock the entry and update it */
-			pthread_mutex_lock(&ep->mutex);
-			ep->count++;
-			pthread_mutex_unlock(&ep->mutex);
-			return;
+/* is a ring full, to the thread that fills it */
+static inline int ring_full(struct ring *rp)
+{
+	return rp->tail - __atomic_load_n(&rp->head, __ATOMIC_ACQUIRE) ==
+		RINGSIZE;
+}
+
+static void ring_push(struct ring *rp, struct shard *s, struct batch *b)
+{
+	unsigned long tail = rp->tail;
+
+	/* wait for the owner to make room, asleep if it takes a while */
+	for (int i = 0; ring_full(rp); i++)
+		if (i < FREQ_SPINS) {
+			freq_cpu_relax();
+		} else {
+			uint32_t v = freq_event_arm(&rp->room);
+
+			if (ring_full(rp))
+				freq_event_wait(&rp->room, v);
 		}
 
-	/* upgrade to the bucket write lock */
-	pthread_rwlock_unlock(&H[h].rwlock);
-	pthread_rwlock_wrlock(&H[h].rwlock);
+	rp->slots[tail % RINGSIZE] = b;
+	__atomic_store_n(&rp->tail, tail + 1, __ATOMIC_RELEASE);
+	freq_event_signal(&s->work);
+}
+
+/* next batch in a ring, NULL if it is empty right now */
+static struct batch *ring_pop(struct ring *rp)
+{
+	unsigned long head = rp->head;
+	struct batch *b;
+
+	if (head == __atomic_load_n(&rp->tail, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	b = rp->slots[head % RINGSIZE];
+	__atomic_store_n(&rp->head, head + 1, __ATOMIC_RELEASE);
+	freq_event_signal(&rp->room);
+	return b;
+}
+
+/* run the calling thread on a shard's node, on its n-th CPU if pinning */
+static void bind_node(struct shard *s, int n)
+{
+	cpu_set_t set;
+
+	if (!Numa)
+		return;
+
+	if (Pin) {
+		int cpu = -1;
+
+		CPU_ZERO(&set);
+		n %= CPU_COUNT(&s->cpus);
+		while (n-- >= 0)
+			while (!CPU_ISSET(++cpu, &s->cpus))
+				;
+		CPU_SET(cpu, &set);
+	} else {
+		set = s->cpus;
+	}
+
+	if ((errno = pthread_setaffinity_np(pthread_self(), sizeof(set),
+			&set)) != 0)
+		err(1, "pthread_setaffinity_np");
 
-	/* allocate new entry in table */
-	if ((ep = calloc(1, sizeof(*ep))) == NULL)
+	/* allocations from here on come from the node we run on */
+	numa_set_localalloc();
+}
+
+/* words collected by one file thread, a batch per shard */
+struct router {
+	int id;			/* file number */
+	const char *fname;
+	int node;		/* node the thread runs on if pinning */
+	struct batch **batches;
+};
+
+/* hand a full batch over to the shard that counts it */
+static void submit(struct router *r, struct shard *s, struct batch *b)
+{
+	if (Rings != NULL)
+		ring_push(&Rings[r->id * Nshards + (s - Shards)], s, b);
+	else
+		shard_push(s, b);
+}
+
+static void route_word(const char *word, void *arg)
+{
+	struct router *r = arg;
+	struct shard *s = word_shard(word);
+	struct batch **bp = &r->batches[s - Shards];
+	size_t len = strlen(word) + 1;
+
+	if (*bp != NULL && (*bp)->used + len > BATCHSIZE) {
+		submit(r, s, *bp);
+		*bp = NULL;
+	}
+
+	if (*bp == NULL) {
+		if ((*bp = malloc(sizeof(**bp))) == NULL)
+			err(1, "malloc");
+		(*bp)->used = 0;
+	}
+
+	memcpy((*bp)->buf + (*bp)->used, word, len);
+	(*bp)->used += len;
+}
+
+/* file thread, tokenize one file and route its words to their shards */
+void *route_all_words(void *arg)
+{
+	struct router *r = arg;
+
+	if (Pin)
+		bind_node(&Shards[r->node], 0);
+
+	if ((r->batches = calloc(Nshards, sizeof(*r->batches))) == NULL)
 		err(1, "calloc");
 
-	if ((ep->word = strdup(word)) == NULL)
-		err(1, "strdup");
+	freq_tokenize_file(r->fname, &Opts, route_word, r);
+
+	for (int i = 0; i < Nshards; i++) {
+		if (r->batches[i] != NULL)
+			submit(r, &Shards[i], r->batches[i]);
+		if (Rings != NULL) {
+			__atomic_store_n(&Rings[r->id * Nshards + i].done, 1,
+					__ATOMIC_RELEASE);
+			freq_event_signal(&Shards[i].work);
+		}
+	}
 
-	ep->count = 1;
+	free(r->batches);
+	return NULL;
+}
 
-	/* add it to the front of the linked list */
-	ep->next = H[h].entries;
-	H[h].entries = ep;
+/* count the words of one batch, FREQ_BATCH at a time */
+static void count_batch(struct freq_table *t, struct batch *b)
+{
+	const char *words[FREQ_BATCH];
+	size_t lens[FREQ_BATCH];
+	size_t n = 0;
+
+	for (size_t i = 0; i < b->used; i += lens[n++] + 1) {
+		if (n == FREQ_BATCH) {
+			freq_count_batch(t, words, lens, n);
+			n = 0;
+		}
+		words[n] = b->buf + i;
+		lens[n] = strlen(words[n]);
+	}
 
-	pthread_rwlock_unlock(&H[h].rwlock);
+	freq_count_batch(t, words, lens, n);
+	free(b);
 }
 
-#define MAXWORD 8192
+/* worker on a shard's node, or the owner of a shard with -r */
+struct worker {
+	struct shard *shard;
+	int n;			/* worker number on the node, files with -r */
+};
 
-/* break a test file into words and call count() on each one */
-void *count_all_words(void *arg)
+/* worker thread, count the words of every batch pushed to its shard */
+void *count_batches(void *arg)
 {
-	const char *fname = (const char *)arg;
-	FILE *fp;
-	int c;
-	char word[MAXWORD];
-	char *ptr;
-
-	if ((fp = fopen(fname, "r")) == NULL)
-		err(1, "fopen: %s", fname);
-
-	ptr = NULL;
-	while ((c = getc(fp)) != EOF)
-		if (isalpha(c)) {
-			if (ptr == NULL) {
-				/* starting a new word */
-				ptr = word;
-				*ptr++ = c;
-			} else if (ptr < &word[MAXWORD - 1])
-				/* add character to current word */
-				*ptr++ = c;
-			else {
-				/* word too long, truncate it */
-				*ptr++ = '\0';
-				count(word);
-				ptr = NULL;
+	struct worker *w = arg;
+	struct shard *s = w->shard;
+	struct batch *b;
+
+	bind_node(s, w->n);
+
+	while ((b = shard_pop(s)) != NULL)
+		count_batch(s->table, b);
+
+	return NULL;
+}
+
+/* owner thread, drain the rings of its shard until every file is done */
+void *own_shard(void *arg)
+{
+	struct worker *w = arg;
+	struct shard *s = w->shard;
+	int nfiles = w->n;
+	int spins = 0;
+	uint32_t armed = 0;	/* what s->work was armed with, 0 if not */
+	int live;
+
+	do {
+		int idle = 1;
+
+		live = 0;
+		for (int i = 0; i < nfiles; i++) {
+			struct ring *rp = &Rings[i * Nshards + (s - Shards)];
+			int done = __atomic_load_n(&rp->done, __ATOMIC_ACQUIRE);
+			struct batch *b;
+
+			/* anything pushed before done was set is seen here */
+			while ((b = ring_pop(rp)) != NULL) {
+				count_batch(s->table, b);
+				idle = 0;
 			}
-		} else if (ptr != NULL) {
-			/* word ended, store it */
-			*ptr++ = '\0';
-			count(word);
-			ptr = NULL;
+
+			if (!done)
+				live++;
 		}
 
-	/* handle the last word */
-	if (ptr != NULL) {
-		/* word ended, store it */
-		*ptr++ = '\0';
-		count(word);
-	}
+		/* nothing to do: spin, then look once more armed, then sleep */
+		if (!idle || !live) {
+			spins = 0;
+			armed = 0;
+		} else if (spins < FREQ_SPINS) {
+			spins++;
+			freq_cpu_relax();
+		} else if (armed == 0) {
+			armed = freq_event_arm(&s->work);
+		} else {
+			freq_event_wait(&s->work, armed);
+			spins = 0;
+			armed = 0;
+		}
+	} while (live);
 
-	fclose(fp);
 	return NULL;
 }
 
-/* print all entries in the hash table */
-void print_counts()
+/* each shard holds the words that hash to it, so a share of the limits */
+static void shard_limit(struct freq_table *t)
+{
+	freq_set_max_entries(t, (MaxEntries + Nshards - 1) / Nshards);
+	freq_set_max_memory(t, (MaxMemory + Nshards - 1) / Nshards);
+}
+
+/* nshards private tables, each fed through its own rings */
+static void rings_create(int nshards, int nfiles)
 {
-	struct entry *ep;
+	Nshards = nshards;
+
+	Shards = calloc_lines(Nshards, sizeof(*Shards));
+	Rings = calloc_lines((size_t)nfiles * Nshards, sizeof(*Rings));
 
-	for (int i = 0; i < NBUCKETS; i++)
-		for (ep = H[i].entries; ep != NULL; ep = ep->next)
-			printf("%d %s\n", ep->count, ep->word);
+	for (int i = 0; i < Nshards; i++) {
+		Shards[i].table = freq_volatile_create(0);
+		shard_limit(Shards[i].table);
+		if (Spill != NULL)
+			freq_set_spill(Shards[i].table, Spill, 0);
+	}
 }
 
-int main(int argc, char *argv[])
+/* one shard per NUMA node, each table allocated on its own node */
+static void shards_create(void)
 {
-	int pflag = 0;
-	int arg = 1;	/* index into argv[] for first file name */
+	/* without NUMA support everything is on one node */
+	Numa = numa_available() >= 0;
+	Nshards = Numa ? numa_max_node() + 1 : 1;
+
+	Shards = calloc_lines(Nshards, sizeof(*Shards));
+
+	for (int i = 0; i < Nshards; i++) {
+		struct shard *s = &Shards[i];
+
+		s->node = i;
+		if (Numa) {
+			/* libnuma's CPU lists aren't thread safe to build */
+			struct bitmask *cpus = numa_allocate_cpumask();
 
-	if (argc > 1 && strcmp(argv[1], "-p") == 0) {
-		pflag++;
-		arg++;
+			if (numa_node_to_cpus(i, cpus) < 0)
+				err(1, "numa_node_to_cpus %d", i);
+			CPU_ZERO(&s->cpus);
+			for (unsigned cpu = 0; cpu < cpus->size &&
+					cpu < CPU_SETSIZE; cpu++)
+				if (numa_bitmask_isbitset(cpus, cpu))
+					CPU_SET(cpu, &s->cpus);
+			numa_free_cpumask(cpus);
+
+			if (CPU_COUNT(&s->cpus) == 0)
+				errx(1, "NUMA node %d has no CPUs", i);
+
+			numa_set_preferred(i);
+		}
+		s->table = freq_concurrent_create();
+		shard_limit(s->table);
+		pthread_mutex_init(&s->lock, NULL);
+		pthread_cond_init(&s->cond, NULL);
+	}
+
+	if (Numa)
+		numa_set_localalloc();
+}
+
+/* route the words of every file to the shards and count them there */
+static void count_sharded(char *files[], int nfiles, int nworkers)
+{
+	int nthreads = Rings != NULL ? Nshards : Nshards * nworkers;
+	pthread_t wtids[nthreads];
+	struct worker workers[nthreads];
+	pthread_t tids[nfiles];
+	struct router routers[nfiles];
+
+	for (int i = 0; i < nthreads; i++) {
+		if (Rings != NULL) {
+			/* an owner needs the number of rings to drain */
+			workers[i].shard = &Shards[i];
+			workers[i].n = nfiles;
+		} else {
+			workers[i].shard = &Shards[i / nworkers];
+			workers[i].n = i % nworkers;
+		}
+		if ((errno = pthread_create(&wtids[i], NULL, Rings != NULL ?
+				own_shard : count_batches, &workers[i])) != 0)
+			err(1, "pthread_create worker %d of %d", i, nthreads);
+	}
+
+	for (int i = 0; i < nfiles; i++) {
+		/* spread file threads over the nodes too */
+		routers[i].id = i;
+		routers[i].fname = files[i];
+		routers[i].node = i % Nshards;
+		if ((errno = pthread_create(&tids[i], NULL,
+				route_all_words, &routers[i])) != 0)
+			err(1, "pthread_create %d of %d", i, nfiles);
 	}
 
-	if (argv[arg] == NULL) {
-		fprintf(stderr, "usage: %s [-p] wordfiles...\n", argv[0]);
-		exit(1);
+	for (int i = 0; i < nfiles; i++)
+		pthread_join(tids[i], NULL);
+
+	for (int i = 0; Rings == NULL && i < Nshards; i++) {
+		pthread_mutex_lock(&Shards[i].lock);
+		Shards[i].done = 1;
+		pthread_cond_broadcast(&Shards[i].cond);
+		pthread_mutex_unlock(&Shards[i].lock);
 	}
 
+	for (int i = 0; i < nthreads; i++)
+		pthread_join(wtids[i], NULL);
+}
+
+/* say how far pruning may have left the counts short, if it did */
+static void report_pruning(const char *cmd, uint64_t pruned, uint64_t error)
+{
+	if (error != 0)
+		fprintf(stderr, "%s: pruned %" PRIu64 " entries, counts may "
+				"be up to %" PRIu64 " short\n", cmd, pruned,
+				error);
+}
+
+/* options with no short form */
+enum { OPT_STATS = 256 };
+
+static const struct option longopts[] = {
+	FREQ_TOKOPTS_LONG,
+	{ "max-entries", required_argument, NULL, 'l' },
+	{ "max-memory", required_argument, NULL, 'm' },
+	{ "spill", required_argument, NULL, 'D' },
+	{ "stats", no_argument, NULL, OPT_STATS },
+	{ NULL, 0, NULL, 0 }
+};
+
+void usage(const char *cmd)
+{
+	fprintf(stderr, "usage: %s [-p] [-l|--max-entries n] "
+			"[-m|--max-memory size] [--stats] "
+			"[-n [-P] [-t workers] | -r shards [-D|--spill dir]] "
+			FREQ_TOKOPTS_USAGE " wordfiles...\n", cmd);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	int pflag = 0;
+	int nflag = 0;
+	int sflag = 0;
+	int tflag = 0;
+	int nworkers = 1;	/* workers per node with -n */
+	int nshards = 0;	/* private shards with -r */
+	int c;
+
+	while ((c = getopt_long(argc, argv, "D:l:m:npPr:t:" FREQ_TOKOPTS,
+			longopts, NULL)) != -1)
+		switch (c) {
+		case 'D':
+			Spill = optarg;
+			break;
+		case 'l':
+			if (freq_parse_count(optarg, &MaxEntries) < 0 ||
+			    MaxEntries == 0)
+				usage(argv[0]);
+			break;
+		case 'm':
+			if (freq_parse_size(optarg, &MaxMemory) < 0 ||
+			    MaxMemory == 0)
+				usage(argv[0]);
+			break;
+		case 'n':
+			nflag++;
+			break;
+		case 'p':
+			pflag++;
+			break;
+		case 'P':
+			Pin++;
+			break;
+		case 'r':
+			if ((nshards = atoi(optarg)) < 1)
+				usage(argv[0]);
+			break;
+		case OPT_STATS:
+			sflag++;
+			break;
+		case 't':
+			if ((nworkers = atoi(optarg)) < 1)
+				usage(argv[0]);
+			tflag++;
+			break;
+		default:
+			if (freq_tokopt(&Opts, c, optarg) < 0)
+				usage(argv[0]);
+		}
+
+	freq_tokopts_setup(&Opts);
+
+	int arg = optind;	/* index into argv[] for first file name */
+
+	if (argv[arg] == NULL)
+		usage(argv[0]);
+
 	int nfiles = argc - arg;
+
+	/*
+	 * -P and -t only mean something for node shards, and only private
+	 * tables can be spilled while counting goes on
+	 */
+	if ((nflag && nshards) || ((Pin || tflag) && !nflag) ||
+	    (Spill != NULL && (nshards == 0 ||
+	    (MaxEntries == 0 && MaxMemory == 0))))
+		usage(argv[0]);
+
+	if (nflag || nshards) {
+		if (nflag)
+			shards_create();
+		else
+			rings_create(nshards, nfiles);
+		count_sharded(&argv[arg], nfiles, nworkers);
+
+		struct freq_stats all = { 0 }, st;
+		uint64_t pruned = 0, error = 0;
+
+		for (int i = 0; i < Nshards; i++) {
+			struct freq_table *t = Shards[i].table;
+
+			if (pflag)
+				freq_print(t);
+
+			freq_stats(t, &st);
+			freq_stats_add(&all, &st);
+
+			/* a word is only ever in one shard */
+			pruned += t->pruned;
+			if (freq_error(t) > error)
+				error = freq_error(t);
+			freq_close(t);
+		}
+
+		if (sflag)
+			freq_print_stats(argv[0], &all);
+		report_pruning(argv[0], pruned, error);
+
+		exit(0);
+	}
+
+	T = freq_concurrent_create();
+	freq_set_max_entries(T, MaxEntries);
+	freq_set_max_memory(T, MaxMemory);
+
 	pthread_t tids[nfiles];
 
 	for (int i = 0; i < nfiles; i++)
 		if ((errno = pthread_create(&tids[i], NULL,
-				count_all_words, (void *)argv[arg])) != 0)
+				count_all_words, (void *)argv[arg + i])) != 0)
 			err(1, "pthread_create %d of %d", i, nfiles);
 
 	for (int i = 0; i < nfiles; i++)
 		pthread_join(tids[i], NULL);
 
 	if (pflag)
-		print_counts();
+		freq_print(T);
+
+	if (sflag) {
+		struct freq_stats st;
+
+		freq_stats(T, &st);
+		freq_print_stats(argv[0], &st);
+	}
 
+	report_pruning(argv[0], T->pruned, freq_error(T));
+	freq_close(T);
 	exit(0);
 }
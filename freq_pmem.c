@@ -4,212 +4,91 @@
  * create the pool for this program using pmempool, for example:
  *	pmempool create obj --layout=freq -s 1G freqcount
  *	freq_pmem freqcount file1.txt file2.txt...
+ *
+ * -i adds the counts in a snapshot from freq_pmem_print -o to the pool
+ * before any files are counted, and can be given more than once.  With
+ * neither, the pool is just opened, which brings a table written by an
+ * older version up to date for the tools that only read it.
  */
-#include <ctype.h>
 #include <err.h>
 #include <errno.h>
-#include <libpmemobj.h>
+#include <getopt.h>
 #include <pthread.h>
-#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <string.h>
 #include <unistd.h>
 
-/* declare all the types used in the layout of our pmempool file */
-POBJ_LAYOUT_BEGIN(freq);
-POBJ_LAYOUT_ROOT(freq, struct root);
-POBJ_LAYOUT_TOID(freq, struct entry);
-POBJ_LAYOUT_TOID(freq, char);
-POBJ_LAYOUT_TOID(freq, struct bucket);
-POBJ_LAYOUT_END(freq);
-
-/* root object definition */
-struct root {
-	TOID(struct bucket) h;	/* hash table for word frequencies */
-	/* ... OIDs for other things we store in this pool go here... */
-};
-
-#define NBUCKETS 10007
+#include "libfreq_pmem.h"
 
-/* entries in a bucket are a linked list of struct entry */
-struct entry {
-	TOID(struct entry) next;
-	TOID(char) word;
-	PMEMmutex mutex;		/* protects count field */
-	int count;
-};
-
-/* each bucket contains a pointer to the linked list of entries */
-struct bucket {
-	PMEMrwlock rwlock;		/* protects entries field */
-	TOID(struct entry) entries;
-};
+struct freq_table *T;		/* table in pmem shared by all threads */
+struct freq_tokopts Opts = { .profile = FREQ_PROFILE_ALPHA };
 
-PMEMobjpool *Pop;	/* pmemobj pool pointer */
-struct bucket *H;	/* run-time pointer to H[] in pmem */
-
-/* hash a string into an index into H[] */
-unsigned hash(const char *s)
-{
-	unsigned h = NBUCKETS ^ ((unsigned)*s++ << 2);
-	unsigned len = 0;
-
-	while (*s) {
-		len++;
-		h ^= (((unsigned)*s) << (len % 3)) +
-		    ((unsigned)*(s - 1) << ((len % 3 + 7)));
-		s++;
-	}
-	h ^= len;
-
-	return h % NBUCKETS;
-}
-
-/* bump the count for a word */
-void count(const char *word)
+/* thread start routine, count all the words in one file */
+void *count_all_words(void *arg)
 {
-	unsigned h = hash(word);
-
-	/* start with the read lock on the bucket */
-	pmemobj_rwlock_rdlock(Pop, &H[h].rwlock);
-
-	TOID(struct entry) ep = H[h].entries;
-
-	for (; !TOID_IS_NULL(ep); ep = D_RW(ep)->next)
-		if (strcmp(word, D_RO(D_RO(ep)->word)) == 0) {
-			/* already in table, just bump the count */
-
-			/* drop bucket lock */
-			pmemobj_rwlock_unlock(Pop, &H[h].rwlock);
-
-			/* lock the entry and update it transactionally */
-			TX_BEGIN_PARAM(Pop, TX_PARAM_MUTEX, &D_RW(ep)->mutex,
-					TX_PARAM_NONE) {
-				TX_ADD(ep);
-				D_RW(ep)->count++;
-			} TX_ONABORT {
-				err(1, "can't bump count for \"%s\"", word);
-			} TX_END
-			return;
-		}
-
-	/* drop the bucket read lock */
-	pmemobj_rwlock_unlock(Pop, &H[h].rwlock);
-
-	/* allocate new entry in table */
-	TX_BEGIN_PARAM(Pop, TX_PARAM_RWLOCK, &H[h].rwlock, TX_PARAM_NONE) {
-
-		/* add field being changed to transaction */
-		pmemobj_tx_add_range_direct(&H[h].entries,
-						sizeof(H[h].entries));
-
-		/* allocate entry struct and fill it in */
-		ep = TX_ZALLOC(struct entry, sizeof(struct entry));
-
-		TOID_ASSIGN(D_RW(ep)->word,
-					TX_STRDUP(word, TOID_TYPE_NUM(char)));
-
-		D_RW(ep)->count = 1;
-
-		/* add it to the front of the linked list */
-		D_RW(ep)->next = H[h].entries;
-		H[h].entries = ep;
-	} TX_ONABORT {
-		err(1, "can't create entry for \"%s\"", word);
-	} TX_END
+	freq_count_file(T, (const char *)arg, &Opts);
+	return NULL;
 }
 
-#define MAXWORD 8192
+static const struct option longopts[] = {
+	{ "import", required_argument, NULL, 'i' },
+	FREQ_TOKOPTS_LONG,
+	{ NULL, 0, NULL, 0 }
+};
 
-/* break a test file into words and call count() on each one */
-void *count_all_words(void *arg)
+void usage(const char *cmd)
 {
-	const char *fname = (const char *)arg;
-	FILE *fp;
-	int c;
-	char word[MAXWORD];
-	char *ptr;
-
-	if ((fp = fopen(fname, "r")) == NULL)
-		err(1, "fopen: %s", fname);
-
-	ptr = NULL;
-	while ((c = getc(fp)) != EOF)
-		if (isalpha(c)) {
-			if (ptr == NULL) {
-				/* starting a new word */
-				ptr = word;
-				*ptr++ = c;
-			} else if (ptr < &word[MAXWORD - 1])
-				/* add character to current word */
-				*ptr++ = c;
-			else {
-				/* word too long, truncate it */
-				*ptr++ = '\0';
-				count(word);
-				ptr = NULL;
-			}
-		} else if (ptr != NULL) {
-			/* word ended, store it */
-			*ptr++ = '\0';
-			count(word);
-			ptr = NULL;
-		}
-
-	/* handle the last word */
-	if (ptr != NULL) {
-		/* word ended, store it */
-		*ptr++ = '\0';
-		count(word);
-	}
-
-	fclose(fp);
-	return NULL;
+	fprintf(stderr,
+		"usage: %s [-i|--import snapshot]... " FREQ_TOKOPTS_USAGE
+		" pmemfile [wordfiles...]\n", cmd);
+	exit(1);
 }
 
 int main(int argc, char *argv[])
 {
-	int arg = 2;	/* index into argv[] for first file name */
+	const char *imports[argc];
+	int nimports = 0;
+	int c;
 
-	if (argv[1] == NULL || argv[arg] == NULL) {
-		fprintf(stderr, "usage: %s pmemfile wordfiles...\n", argv[0]);
-		exit(1);
-	}
+	while ((c = getopt_long(argc, argv, "i:" FREQ_TOKOPTS, longopts,
+			NULL)) != -1)
+		switch (c) {
+		case 'i':
+			imports[nimports++] = optarg;
+			break;
+		default:
+			if (freq_tokopt(&Opts, c, optarg) < 0)
+				usage(argv[0]);
+		}
 
-	Pop = pmemobj_open(argv[1], POBJ_LAYOUT_NAME(freq));
+	freq_tokopts_setup(&Opts);
 
-	if (Pop == NULL)
-		err(1, "pmemobj_open: %s", argv[1]);
+	int arg = optind + 1;	/* index into argv[] for first file name */
 
-	TOID(struct root) root = POBJ_ROOT(Pop, struct root);
+	if (argv[optind] == NULL)
+		usage(argv[0]);
 
-	/* before starting, see if buckets have been allocated */
-	if (TOID_IS_NULL(D_RW(root)->h)) {
-		/* nope, allocate it now */
-		TX_BEGIN(Pop) {
-			TX_ADD(root);
-			D_RW(root)->h = TX_ZALLOC(struct bucket,
-			    sizeof(struct bucket) * NBUCKETS);
-		} TX_ONABORT {
-			err(1, "cannot allocate hash table");
-		} TX_END
-	}
+	T = freq_pmem_open(argv[optind], FREQ_PMEM_CREATE);
 
-	/* get run-time pointer to hash table */
-	H = D_RW(D_RW(root)->h);
+	for (int i = 0; i < nimports; i++)
+		freq_pmem_import(T, imports[i]);
 
 	int nfiles = argc - arg;
-	pthread_t tids[nfiles];
 
-	for (int i = 0; i < nfiles; i++)
-		if ((errno = pthread_create(&tids[i], NULL,
-				count_all_words, (void *)argv[arg])) != 0)
-			err(1, "pthread_create %d of %d", i, nfiles);
+	/* with only -i, or nothing, there are no threads to start */
+	if (nfiles > 0) {
+		pthread_t tids[nfiles];
 
-	for (int i = 0; i < nfiles; i++)
-		pthread_join(tids[i], NULL);
+		for (int i = 0; i < nfiles; i++)
+			if ((errno = pthread_create(&tids[i], NULL,
+					count_all_words,
+					(void *)argv[arg + i])) != 0)
+				err(1, "pthread_create %d of %d", i, nfiles);
+
+		for (int i = 0; i < nfiles; i++)
+			pthread_join(tids[i], NULL);
+	}
 
-	pmemobj_close(Pop);
+	freq_close(T);
 	exit(0);
 }
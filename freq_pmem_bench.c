@@ -0,0 +1,155 @@
+/*
+ * freq_pmem_bench.c -- time inserting words into a pmem table
+ *
+ * every run counts words the table has never seen, so each count is an
+ * insert with its own transaction and two allocations, and the runs
+ * show how inserting scales with the number of threads doing it.  With
+ * -s the table allocates from libpmemobj's default classes and arenas
+ * instead of its own class and an arena per thread, for comparison.
+ *
+ * the pool needs room for every run, about 100 bytes a word:
+ *	pmempool create obj --layout=freq -s 4G benchpool
+ *	freq_pmem_bench -t 1,2,4,8 benchpool
+ */
+#include <err.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libfreq_pmem.h"
+
+static uint64_t Seed = 88172645463325252ULL;
+
+/* xorshift64, the same stream on every run */
+static uint64_t rnd(void)
+{
+	Seed ^= Seed << 13;
+	Seed ^= Seed >> 7;
+	Seed ^= Seed << 17;
+	return Seed;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* one thread's slice of the words */
+struct slice {
+	struct freq_table *t;
+	char **words;
+	size_t n;
+};
+
+static void *insert_slice(void *arg)
+{
+	struct slice *sp = arg;
+
+	for (size_t i = 0; i < sp->n; i++)
+		freq_count(sp->t, sp->words[i]);
+
+	return NULL;
+}
+
+/* inserts per second for nthreads inserting nwords new words at once */
+static double run(const char *path, int flags, int nthreads, size_t nwords)
+{
+	char **words = malloc(nwords * sizeof(*words));
+	struct slice slices[nthreads];
+	pthread_t tids[nthreads];
+
+	if (words == NULL)
+		err(1, "malloc");
+
+	/* 16 random letters, never the same word twice in practice */
+	for (size_t i = 0; i < nwords; i++) {
+		if ((words[i] = malloc(17)) == NULL)
+			err(1, "malloc");
+		for (int j = 0; j < 16; j++)
+			words[i][j] = 'a' + rnd() % 26;
+		words[i][16] = '\0';
+	}
+
+	struct freq_table *t = freq_pmem_open(path, FREQ_PMEM_CREATE | flags);
+	double start = now();
+
+	for (int i = 0; i < nthreads; i++) {
+		size_t from = nwords * i / nthreads;
+
+		slices[i].t = t;
+		slices[i].words = words + from;
+		slices[i].n = nwords * (i + 1) / nthreads - from;
+		if ((errno = pthread_create(&tids[i], NULL, insert_slice,
+				&slices[i])) != 0)
+			err(1, "pthread_create %d of %d", i, nthreads);
+	}
+
+	for (int i = 0; i < nthreads; i++)
+		pthread_join(tids[i], NULL);
+
+	double rate = nwords / (now() - start);
+
+	freq_close(t);
+
+	for (size_t i = 0; i < nwords; i++)
+		free(words[i]);
+	free(words);
+	return rate;
+}
+
+void usage(const char *cmd)
+{
+	fprintf(stderr, "usage: %s [-s] [-t threads,...] [-w words] "
+			"pmemfile\n", cmd);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	size_t nwords = 1000000;
+	char *threads = strdup("1,2,4,8");
+	int flags = 0;
+	int c;
+
+	while ((c = getopt(argc, argv, "st:w:")) != -1)
+		switch (c) {
+		case 's':
+			flags |= FREQ_PMEM_SHARED_HEAP;
+			break;
+		case 't':
+			threads = optarg;
+			break;
+		case 'w':
+			nwords = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+
+	if (nwords == 0 || optind != argc - 1)
+		usage(argv[0]);
+
+	printf("%s, %zu new words a run\n", flags & FREQ_PMEM_SHARED_HEAP ?
+			"shared heap" : "entry class, arena per thread",
+			nwords);
+
+	for (char *s = strtok(threads, ","); s != NULL;
+			s = strtok(NULL, ",")) {
+		int n = atoi(s);
+
+		if (n < 1)
+			usage(argv[0]);
+		printf("%3d thread%s %12.0f inserts/s\n", n, n == 1 ? " " : "s",
+				run(argv[optind], flags, n, nwords));
+	}
+
+	exit(0);
+}
@@ -4,157 +4,116 @@
  * create the pool for this program using pmempool, for example:
  *	pmempool create obj --layout=freq -s 1G freqcount
  *	freq_pmem_cpp freqcount file1.txt file2.txt...
+ *
+ * the counter is a WordCounter whose storage policy is the pmem table in
+ * be_pmem.c, so the pool has the same layout freq_pmem writes and either
+ * program, or freq_pmem_print, can open it.  Each file is counted by its
+ * own thread, as in freq_pmem.
  */
-#include <ctype.h>
 #include <err.h>
-#include <errno.h>
-#include <libpmemobj.h>
-#include <pthread.h>
-#include <stdarg.h>
+#include <getopt.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <string.h>
-#include <unistd.h>
 
+#include <functional>
 #include <iostream>
-#include <libpmemobj++/make_persistent.hpp>
-#include <libpmemobj++/p.hpp>
-#include <libpmemobj++/persistent_ptr.hpp>
-#include <libpmemobj++/pool.hpp>
-#include <libpmemobj++/transaction.hpp>
-
-#define LAYOUT "freq"
-#define NBUCKETS 10007
-
-using nvml::obj::p;
-using nvml::obj::persistent_ptr;
-using nvml::obj::pool;
-using nvml::obj::pool_base;
-using nvml::obj::make_persistent;
-using nvml::obj::delete_persistent;
-using nvml::obj::transaction;
-
-class freq {
-
-	/* entries in a bucket are a linked list of struct entry */
-	struct entry {
-		persistent_ptr<struct entry> next;
-		persistent_ptr<char> word;
-		PMEMmutex mutex;		/* protects count field */
-		p<int> count;
-	};
+#include <thread>
+#include <vector>
 
-	/* each bucket contains a pointer to the linked list of entries */
-	struct bucket {
-		PMEMrwlock rwlock;		/* protects entries field */
-		persistent_ptr<struct entry> entries;
-	};
+#include "chartab.hpp"
+#include "libfreq_pmem.h"
+#include "wordcounter.hpp"
 
-public:
-	/* hash a string into an index into h[] */
-	unsigned hash(const char *s)
-	{
-		unsigned h = NBUCKETS ^ ((unsigned)*s++ << 2);
-		unsigned len = 0;
-
-		while (*s) {
-			len++;
-			h ^= (((unsigned)*s) << (len % 3)) +
-			    ((unsigned)*(s - 1) << ((len % 3 + 7)));
-			s++;
+using libfreq::WordCounter;
+using libfreq::ClassicHash;
+using libfreq::NoLock;
+using libfreq::tokenize_file;
+
+/*
+ * storage policy for the table in a pmem pool; be_pmem.c picks buckets
+ * with freq_hash(), ClassicHash reduced mod FREQ_NBUCKETS, so the hash
+ * handed to count() must be ClassicHash's and becomes the bucket.  The
+ * table locks its buckets and entries itself, so NoLock is the lock
+ * policy to pair it with.
+ */
+struct Pmem {
+	template <class L, class C>
+	class table {
+		struct freq_table *t;
+
+		template <class F>
+		static void walk_fn(const char *word, uint64_t count, void *arg)
+		{
+			(*(F *)arg)(word, (C)count);
 		}
-		h ^= len;
-
-		return h % NBUCKETS;
-	}
-
-	/* bump the count for a word */
-	void count(const char *word)
-	{
-		/* XXX */
-		std::cerr << "count: " << word << std::endl;
-	}
-
-#define MAXWORD 8192
-
-	/* break a test file into words and call count() on each one */
-	void *count_all_words(void *arg)
-	{
-		const char *fname = (const char *)arg;
-		FILE *fp;
-		int c;
-		char word[MAXWORD];
-		char *ptr;
-
-		if ((fp = fopen(fname, "r")) == NULL)
-			err(1, "fopen: %s", fname);
-
-		ptr = NULL;
-		while ((c = getc(fp)) != EOF)
-			if (isalpha(c)) {
-				if (ptr == NULL) {
-					/* starting a new word */
-					ptr = word;
-					*ptr++ = c;
-				} else if (ptr < &word[MAXWORD - 1])
-					/* add character to current word */
-					*ptr++ = c;
-				else {
-					/* word too long, truncate it */
-					*ptr++ = '\0';
-					count(word);
-					ptr = NULL;
-				}
-			} else if (ptr != NULL) {
-				/* word ended, store it */
-				*ptr++ = '\0';
-				count(word);
-				ptr = NULL;
-			}
-
-		/* handle the last word */
-		if (ptr != NULL) {
-			/* word ended, store it */
-			*ptr++ = '\0';
-			count(word);
+
+	public:
+		explicit table(const char *path) :
+			t(freq_pmem_open(path, FREQ_PMEM_CREATE)) {}
+
+		~table()
+		{
+			freq_close(t);
 		}
 
-		fclose(fp);
-		return NULL;
-	}
+		/* bump the count for a word */
+		void count(const char *word, size_t hash)
+		{
+			freq_pmem_add(t, word, hash % FREQ_NBUCKETS, 1);
+		}
 
-private:
-	/* hash table for word frequencies */
-	persistent_ptr<struct bucket *> h;
+		/* call fn(word, count) for every entry */
+		template <class F> void walk(F fn)
+		{
+			freq_walk(t, walk_fn<F>, &fn);
+		}
+	};
 };
 
-struct root {
-	persistent_ptr<class freq> freq;	/* word frequencies */
-	/* ... other things we store in this pool go here... */
+typedef WordCounter<ClassicHash, Pmem, NoLock, uint64_t> pmem_counter;
+
+static const struct option longopts[] = {
+	FREQ_TOKOPTS_LONG,
+	{ NULL, 0, NULL, 0 }
 };
 
+static void usage(const char *cmd)
+{
+	std::cerr << "usage: " << cmd << " " FREQ_TOKOPTS_USAGE
+		  << " pmemfile wordfiles..." << std::endl;
+	exit(1);
+}
 
 int main(int argc, char *argv[])
 {
-	if (argc < 3) {
-		std::cerr << "usage: " << argv[0]
-			  << " pmemfile wordfiles..." << std::endl;
-		exit(1);
-	}
-
-	auto pop = pool<root>::open(argv[1], LAYOUT);
-	auto q = pop.get_root();
-
-	/* before starting, see if buckets have been allocated */
-	if (q->freq == nullptr) {
-		/* XXX */
-		std::cerr << "q->freq is nullptr" << std::endl;
-	} else {
-		std::cerr << "q->freq is NOT nullptr" << std::endl;
-	}
-
-	/* XXX */
-
-	pop.close();
+	struct freq_tokopts opts = { FREQ_PROFILE_ALPHA, 0, 0, NULL, 0, NULL };
+	int c;
+
+	while ((c = getopt_long(argc, argv, FREQ_TOKOPTS, longopts,
+			NULL)) != -1)
+		if (freq_tokopt(&opts, c, optarg) < 0)
+			usage(argv[0]);
+
+	freq_tokopts_setup(&opts);
+
+	int arg = optind + 1;	/* index into argv[] for first file name */
+
+	if (arg >= argc)
+		usage(argv[0]);
+
+	pmem_counter *wc = new pmem_counter(argv[optind]);
+	std::vector<std::thread> threads;
+
+	for (; arg < argc; arg++)
+		threads.emplace_back([wc, &opts](const char *fname) {
+			tokenize_file(fname, opts,
+				[wc](const char *word) { wc->count(word); });
+		}, argv[arg]);
+
+	for (auto &t : threads)
+		t.join();
+
+	delete wc;
 	exit(0);
 }
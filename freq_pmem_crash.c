@@ -0,0 +1,683 @@
+/*
+ * freq_pmem_crash.c -- crash the pmem table mid-update and check the pool
+ *
+ * each run forks a child that updates the pool and dies partway, then
+ * reopens the pool, timing how long recovery takes, and checks every
+ * count in it.  -k picks how the child dies and what it is doing:
+ *
+ *	time	counts the word files, killed with SIGKILL at a random time
+ *		within -d ms (the default)
+ *	count	counts the word files and kills itself inside the nth
+ *		counting transaction, before it commits
+ *	migrate	opens a copy of the pool, whose table must have a layout
+ *		from an older version, and kills itself in the nth bucket
+ *		it migrates
+ *	compact	compacts the table, killed in the nth bucket
+ *	merge	merges srcpool into the pool, killed in the nth batch; the
+ *		merge is then resumed and checked again
+ *
+ * n is picked at random up to -e.  Counting, a word's count must be what
+ * it was before the run plus its finished batches, plus all or none of
+ * each batch the child was in the middle of; merging, all or none of its
+ * count in srcpool, and all of it once the merge is resumed; migrating
+ * and compacting must change no count.  No word may be in the table
+ * twice.  Counting carries on from where the child died, starting over
+ * when the files are done, so the table and its pool grow run by run.
+ *
+ * -S sweeps pool sizes, counting: for each size a pool is created at
+ * pmemfile, which must not exist, given the runs and removed, and the
+ * recovery times for each size are summed up at the end.
+ *
+ * the child dies as a process does, so what it wrote to the pool is in
+ * the page cache, or the pmem, and survives; losing unflushed stores as
+ * in a power failure takes a tool like pmreorder.  The pool is file
+ * backed like any other, and PMEM_IS_PMEM_FORCE is set unless it is in
+ * the environment already, so flushes aren't msync()s:
+ *	pmempool create obj --layout=freq -s 1G crashpool
+ *	freq_pmem_crash -n 100 crashpool words.txt
+ *	freq_pmem_crash -k count -S 64M,256M,1G -n 20 newpool words.txt
+ */
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libfreq_pmem.h"
+
+#define MAXTHREADS	16	/* the check tries every subset of batches */
+#define MAXBAD		10	/* mismatches reported a run */
+#define MAXSIZES	16	/* pool sizes -S sweeps */
+
+/* how the child dies, see above */
+enum kill { K_TIME, K_COUNT, K_MIGRATE, K_COMPACT, K_MERGE };
+
+static const char *const Kills[] = {
+	"time", "count", "migrate", "compact", "merge"
+};
+
+/* default -e for each, about how often the child reaches its point */
+static const uint64_t Hits[] = {
+	0, 1000, 2 * FREQ_NBUCKETS, FREQ_NBUCKETS, 16
+};
+
+struct freq_tokopts Opts = { .profile = FREQ_PROFILE_ALPHA };
+
+static uint64_t Seed = 88172645463325252ULL;
+
+/* xorshift64, the same stream on every run unless -r changes it */
+static uint64_t rnd(void)
+{
+	Seed ^= Seed << 13;
+	Seed ^= Seed >> 7;
+	Seed ^= Seed << 17;
+	return Seed;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* every word of the files, in order */
+static char **Words;
+static size_t *Lens;
+static size_t Nwords;
+
+static void save_word(const char *word, void *arg)
+{
+	static size_t max;
+
+	if (Nwords == max) {
+		max = max ? 2 * max : 1024 * 1024;
+		if ((Words = realloc(Words, max * sizeof(*Words))) == NULL ||
+		    (Lens = realloc(Lens, max * sizeof(*Lens))) == NULL)
+			err(1, "realloc");
+	}
+	if ((Words[Nwords] = strdup(word)) == NULL)
+		err(1, "strdup");
+	Lens[Nwords++] = strlen(word);
+}
+
+/*
+ * one thread's slice of the words; done is shared with the child, which
+ * advances it past each batch it has counted
+ */
+struct slice {
+	struct freq_table *t;
+	size_t from, end;	/* next word to count, end of the slice */
+	size_t *done;
+};
+
+/* thread start routine in the child, count a slice a batch at a time */
+static void *count_slice(void *arg)
+{
+	struct slice *sp = arg;
+
+	for (size_t i = sp->from; i < sp->end; ) {
+		size_t n = sp->end - i < FREQ_BATCH ? sp->end - i : FREQ_BATCH;
+
+		freq_count_batch(sp->t, (const char *const *)Words + i,
+				Lens + i, n);
+		i += n;
+		__atomic_store_n(sp->done, i, __ATOMIC_RELEASE);
+	}
+
+	return NULL;
+}
+
+/* the child, do what -k says to path and exit */
+static void child(enum kill k, const char *path, const char *src,
+		struct slice *slices, int nthreads)
+{
+	pthread_t tids[nthreads];
+	struct freq_table *t, *st;
+
+	switch (k) {
+	case K_TIME:
+	case K_COUNT:
+		t = freq_pmem_open(path, FREQ_PMEM_CREATE);
+		for (int i = 0; i < nthreads; i++) {
+			slices[i].t = t;
+			if ((errno = pthread_create(&tids[i], NULL,
+					count_slice, &slices[i])) != 0)
+				err(1, "pthread_create %d of %d", i,
+						nthreads);
+		}
+		for (int i = 0; i < nthreads; i++)
+			pthread_join(tids[i], NULL);
+		freq_close(t);
+		break;
+	case K_MIGRATE:
+		freq_close(freq_pmem_open(path, 0));
+		break;
+	case K_COMPACT:
+		t = freq_pmem_open(path, 0);
+		freq_pmem_compact(t);
+		freq_close(t);
+		break;
+	case K_MERGE:
+		st = freq_pmem_open(src, FREQ_PMEM_RDONLY);
+		t = freq_pmem_open(path, 0);
+		freq_pmem_merge(t, st, nthreads);
+		freq_close(t);
+		freq_close(st);
+		break;
+	}
+
+	_exit(0);
+}
+
+/*
+ * a word's count from one source: the table before the run, the pool
+ * after it, what the child finished, or what it may or may not have
+ * (tag 0 and up, a thread's unfinished batch or srcpool's count)
+ */
+#define TAG_BASE	-3
+#define TAG_POOL	-2
+#define TAG_DONE	-1
+
+struct rec {
+	char *word;
+	uint64_t n;
+	int tag;
+};
+
+struct recs {
+	struct rec *r;
+	size_t n, max;
+	int tag;		/* for walk_rec() */
+};
+
+static void add_rec(struct recs *rs, const char *word, uint64_t n, int tag)
+{
+	if (rs->n == rs->max) {
+		rs->max = rs->max ? 2 * rs->max : 1024;
+		if ((rs->r = realloc(rs->r, rs->max * sizeof(*rs->r))) == NULL)
+			err(1, "realloc");
+	}
+	if ((rs->r[rs->n].word = strdup(word)) == NULL)
+		err(1, "strdup");
+	rs->r[rs->n].n = n;
+	rs->r[rs->n++].tag = tag;
+}
+
+static void walk_rec(const char *word, uint64_t count, void *arg)
+{
+	struct recs *rs = arg;
+
+	add_rec(rs, word, count, rs->tag);
+}
+
+/* add every record of from to rs, with tag */
+static void copy_recs(struct recs *rs, const struct recs *from, int tag)
+{
+	for (size_t i = 0; i < from->n; i++)
+		add_rec(rs, from->r[i].word, from->r[i].n, tag);
+}
+
+/* count words from to end in DRAM and add the counts to rs */
+static void count_recs(struct recs *rs, size_t from, size_t end, int tag)
+{
+	struct freq_table *t = freq_volatile_create(0);
+
+	for (size_t i = from; i < end; i++)
+		freq_count(t, Words[i]);
+
+	rs->tag = tag;
+	freq_walk(t, walk_rec, rs);
+	freq_close(t);
+}
+
+static void free_recs(struct recs *rs)
+{
+	for (size_t i = 0; i < rs->n; i++)
+		free(rs->r[i].word);
+	rs->n = 0;
+}
+
+/* how long reopening a pool took, and walking it */
+struct reopen {
+	double open_ms, walk_ms;
+	uint64_t entries;
+	struct freq_pmem_usage u;
+};
+
+/* reopen path and add its counts to rs, timing it */
+static void reopen(const char *path, struct recs *rs, struct reopen *ro)
+{
+	double start = now();
+	struct freq_table *t = freq_pmem_open(path, 0);
+	double opened = now();
+	size_t n = rs->n;
+
+	rs->tag = TAG_POOL;
+	freq_walk(t, walk_rec, rs);
+	ro->open_ms = (opened - start) * 1e3;
+	ro->walk_ms = (now() - opened) * 1e3;
+	ro->entries = rs->n - n;
+	freq_pmem_usage(t, &ro->u);
+	freq_close(t);
+}
+
+static int cmp_rec(const void *a, const void *b)
+{
+	const struct rec *ra = a, *rb = b;
+	int c = strcmp(ra->word, rb->word);
+
+	return c != 0 ? c : ra->tag - rb->tag;
+}
+
+/* is n the sum of some of the m counts in extra[] */
+static int subset_sum(uint64_t n, const uint64_t *extra, int m)
+{
+	for (unsigned mask = 0; mask < 1U << m; mask++) {
+		uint64_t sum = 0;
+
+		for (int i = 0; i < m; i++)
+			if (mask & (1U << i))
+				sum += extra[i];
+		if (sum == n)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * check the records of a run word by word, and put the pool's counts in
+ * pool; returns the words that are wrong
+ */
+static uint64_t check(struct recs *rs, struct recs *pool)
+{
+	uint64_t bad = 0;
+
+	qsort(rs->r, rs->n, sizeof(*rs->r), cmp_rec);
+
+	for (size_t i = 0, j; i < rs->n; i = j) {
+		uint64_t before = 0, done = 0, got = 0;
+		uint64_t extra[MAXTHREADS];
+		int npool = 0, m = 0;
+
+		for (j = i; j < rs->n && strcmp(rs->r[i].word,
+				rs->r[j].word) == 0; j++)
+			switch (rs->r[j].tag) {
+			case TAG_BASE:
+				before = rs->r[j].n;
+				break;
+			case TAG_POOL:
+				got = rs->r[j].n;
+				npool++;
+				break;
+			case TAG_DONE:
+				done += rs->r[j].n;
+				break;
+			default:
+				extra[m++] = rs->r[j].n;
+			}
+
+		if (npool > 0 && pool != NULL)
+			add_rec(pool, rs->r[i].word, got, TAG_BASE);
+
+		if (npool <= 1 && got >= before + done &&
+		    subset_sum(got - before - done, extra, m))
+			continue;
+
+		if (bad++ < MAXBAD)
+			warnx("\"%s\": %d entries, count %" PRIu64 ", was %"
+					PRIu64 " and %" PRIu64 " were added",
+					rs->r[i].word, npool, got, before,
+					done);
+	}
+
+	free_recs(rs);
+	return bad;
+}
+
+/* copy file from to file to, for a migration to start over on */
+static void copy_file(const char *from, const char *to)
+{
+	static char buf[1 << 20];
+	ssize_t n;
+	int in, out;
+
+	if ((in = open(from, O_RDONLY)) < 0)
+		err(1, "%s", from);
+	if ((out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+		err(1, "%s", to);
+
+	while ((n = read(in, buf, sizeof(buf))) > 0)
+		if (write(out, buf, n) != n)
+			err(1, "%s", to);
+	if (n < 0)
+		err(1, "%s", from);
+
+	close(in);
+	if (close(out) < 0)
+		err(1, "%s", to);
+}
+
+static const struct option longopts[] = {
+	FREQ_TOKOPTS_LONG,
+	{ NULL, 0, NULL, 0 }
+};
+
+void usage(const char *cmd)
+{
+	fprintf(stderr, "usage: %s [-k time|count|migrate|compact|merge] "
+			"[-d maxdelay-ms] [-e maxhits] [-n runs] [-r seed] "
+			"[-S size,...] [-t threads] " FREQ_TOKOPTS_USAGE
+			" pmemfile [wordfiles...|srcpool]\n", cmd);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	struct recs rs = { 0 }, base = { 0 }, src = { 0 };
+	uint64_t sizes[MAXSIZES];
+	int nsizes = 0;
+	enum kill k = K_TIME;
+	long maxdelay = 100;
+	uint64_t maxhits = 0;
+	int nruns = 10;
+	int nthreads = 1;
+	uint64_t nbad = 0;
+	char *s;
+	int c;
+
+	while ((c = getopt_long(argc, argv, "d:e:k:n:r:S:t:" FREQ_TOKOPTS,
+			longopts, NULL)) != -1)
+		switch (c) {
+		case 'd':
+			if ((maxdelay = atol(optarg)) < 1)
+				usage(argv[0]);
+			break;
+		case 'e':
+			if ((maxhits = strtoull(optarg, NULL, 0)) == 0)
+				usage(argv[0]);
+			break;
+		case 'k':
+			for (k = 0; k <= K_MERGE; k++)
+				if (strcmp(optarg, Kills[k]) == 0)
+					break;
+			if (k > K_MERGE)
+				usage(argv[0]);
+			break;
+		case 'n':
+			if ((nruns = atoi(optarg)) < 1)
+				usage(argv[0]);
+			break;
+		case 'r':
+			if ((Seed = strtoull(optarg, NULL, 0)) == 0)
+				usage(argv[0]);
+			break;
+		case 'S':
+			for (s = strtok(optarg, ","); s != NULL;
+					s = strtok(NULL, ","))
+				if (nsizes == MAXSIZES ||
+				    freq_parse_size(s, &sizes[nsizes++]) < 0)
+					usage(argv[0]);
+			break;
+		case 't':
+			nthreads = atoi(optarg);
+			if (nthreads < 1 || nthreads > MAXTHREADS)
+				usage(argv[0]);
+			break;
+		default:
+			if (freq_tokopt(&Opts, c, optarg) < 0)
+				usage(argv[0]);
+		}
+
+	freq_tokopts_setup(&Opts);
+
+	const char *path = argv[optind];
+	const char *srcpool = NULL;
+	int arg = optind + 1;	/* index into argv[] for first file name */
+	int counting = k == K_TIME || k == K_COUNT;
+
+	if (path == NULL || (counting && argv[arg] == NULL) ||
+	    (k == K_MERGE && (argv[arg] == NULL || argv[arg + 1] != NULL)) ||
+	    ((k == K_MIGRATE || k == K_COMPACT) && argv[arg] != NULL) ||
+	    (nsizes != 0 && !counting))
+		usage(argv[0]);
+
+	if (maxhits == 0)
+		maxhits = Hits[k];
+
+	/* read when libpmem first checks a mapping, after this */
+	setenv("PMEM_IS_PMEM_FORCE", "1", 0);
+
+	if (counting) {
+		for (; arg < argc; arg++)
+			freq_tokenize_file(argv[arg], &Opts, save_word, NULL);
+		if (Nwords == 0)
+			errx(1, "no words to count");
+	}
+
+	/* srcpool's counts, all merged into the pool every run */
+	if (k == K_MERGE) {
+		struct freq_table *t = freq_pmem_open(srcpool = argv[arg],
+				FREQ_PMEM_RDONLY);
+
+		src.tag = TAG_DONE;
+		freq_walk(t, walk_rec, &src);
+		freq_close(t);
+	}
+
+	/* a migration starts over on a fresh copy every run */
+	char scratch[strlen(path) + sizeof(".crash")];
+	const char *target = path;
+
+	if (k == K_MIGRATE) {
+		snprintf(scratch, sizeof(scratch), "%s.crash", path);
+		target = scratch;
+	}
+
+	/* where each thread is, shared with the children */
+	size_t *done = mmap(NULL, MAXTHREADS * sizeof(*done),
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+			-1, 0);
+	struct slice slices[nthreads];
+
+	if (done == MAP_FAILED)
+		err(1, "mmap");
+
+	printf("killed by %s", Kills[k]);
+	if (k == K_TIME)
+		printf(" within %ld ms", maxdelay);
+	else
+		printf(" at one of the first %" PRIu64 " points", maxhits);
+	if (counting)
+		printf(", %zu words, %d thread%s", Nwords, nthreads,
+				nthreads == 1 ? "" : "s");
+	printf("\n");
+
+	double open_sum[MAXSIZES], open_max[MAXSIZES];
+	uint64_t entries[MAXSIZES];
+
+	for (int size = 0; size < (nsizes ? nsizes : 1); size++) {
+		if (nsizes != 0) {
+			freq_pmem_create(path, sizes[size]);
+			printf("pool of %" PRIu64 " bytes\n", sizes[size]);
+		}
+
+		/* what the pool holds to begin with, all of it migrated */
+		if (k == K_MIGRATE) {
+			struct reopen ro;
+
+			copy_file(path, target);
+			reopen(target, &rs, &ro);
+			copy_recs(&base, &rs, TAG_BASE);
+			free_recs(&rs);
+		} else {
+			struct freq_table *t = freq_pmem_open(path,
+					FREQ_PMEM_CREATE);
+
+			base.tag = TAG_BASE;
+			freq_walk(t, walk_rec, &base);
+			freq_close(t);
+		}
+
+		for (int i = 0; i < nthreads; i++) {
+			slices[i].from = Nwords * i / nthreads;
+			slices[i].end = Nwords * (i + 1) / nthreads;
+			slices[i].done = &done[i];
+			done[i] = slices[i].from;
+		}
+
+		open_sum[size] = open_max[size] = 0;
+		printf("%4s %8s %12s %14s %10s %10s\n", "run", "child",
+				"entries", "bytes used", "open ms",
+				"walk ms");
+
+		for (int run = 0; run < nruns; run++) {
+			struct reopen ro;
+			uint64_t bad;
+			int status;
+			pid_t pid;
+
+			if (k == K_MIGRATE)
+				copy_file(path, target);
+
+			fflush(stdout);
+			if ((pid = fork()) < 0)
+				err(1, "fork");
+			if (pid == 0) {
+				char point[64];
+
+				if (k != K_TIME) {
+					snprintf(point, sizeof(point),
+						"%s:%" PRIu64, Kills[k],
+						1 + rnd() % maxhits);
+					setenv("FREQ_PMEM_CRASH", point, 1);
+				}
+				child(k, target, srcpool, slices, nthreads);
+			}
+
+			/* keep the parent's stream the same as the child's */
+			if (k != K_TIME)
+				rnd();
+			else {
+				usleep(rnd() % (maxdelay * 1000 + 1));
+				kill(pid, SIGKILL);
+			}
+			if (waitpid(pid, &status, 0) < 0)
+				err(1, "waitpid");
+			if (WIFEXITED(status) && WEXITSTATUS(status) != 0)
+				errx(1, "run %d: child exited %d", run,
+						WEXITSTATUS(status));
+
+			/* recovery happens as the pool is opened */
+			reopen(target, &rs, &ro);
+
+			/* what the child did, finished or not */
+			for (int i = 0; counting && i < nthreads; i++) {
+				size_t end = done[i] + FREQ_BATCH;
+
+				count_recs(&rs, slices[i].from, done[i],
+						TAG_DONE);
+				if (end > slices[i].end)
+					end = slices[i].end;
+				if (done[i] < end)
+					count_recs(&rs, done[i], end, i);
+			}
+			if (k == K_MERGE)
+				copy_recs(&rs, &src, 0);
+			copy_recs(&rs, &base, TAG_BASE);
+
+			/*
+			 * the pool is the next run's base, once a merge is
+			 * finished; a migration starts over from the same one
+			 */
+			if (k == K_TIME || k == K_COUNT || k == K_COMPACT) {
+				struct recs pool = { 0 };
+
+				bad = check(&rs, &pool);
+				free_recs(&base);
+				free(base.r);
+				base = pool;
+			} else
+				bad = check(&rs, NULL);
+
+			/* finish the merge, all of srcpool must be in it */
+			if (k == K_MERGE) {
+				struct recs pool = { 0 };
+				struct reopen rm;
+
+				if (!WIFEXITED(status)) {
+					struct freq_table *st, *t;
+
+					st = freq_pmem_open(srcpool,
+							FREQ_PMEM_RDONLY);
+					t = freq_pmem_open(path, 0);
+					freq_pmem_merge(t, st, nthreads);
+					freq_close(t);
+					freq_close(st);
+				}
+
+				reopen(path, &rs, &rm);
+				copy_recs(&rs, &src, TAG_DONE);
+				copy_recs(&rs, &base, TAG_BASE);
+				bad += check(&rs, &pool);
+				free_recs(&base);
+				free(base.r);
+				base = pool;
+			}
+
+			nbad += bad;
+			open_sum[size] += ro.open_ms;
+			if (ro.open_ms > open_max[size])
+				open_max[size] = ro.open_ms;
+			entries[size] = ro.entries;
+
+			printf("%4d %8s %12" PRIu64 " %14" PRIu64
+					" %10.2f %10.2f %s\n", run,
+					WIFEXITED(status) ? "finished" :
+					"killed", ro.entries, ro.u.bytes,
+					ro.open_ms, ro.walk_ms,
+					bad ? "BAD" : "ok");
+
+			/* the next child redoes unfinished batches */
+			for (int i = 0; i < nthreads; i++) {
+				if (done[i] == slices[i].end)
+					done[i] = Nwords * i / nthreads;
+				slices[i].from = done[i];
+			}
+		}
+
+		free_recs(&base);
+		if (nsizes != 0 && unlink(path) < 0)
+			err(1, "%s", path);
+	}
+
+	if (k == K_MIGRATE && unlink(target) < 0)
+		err(1, "%s", target);
+
+	if (nsizes != 0) {
+		printf("%14s %12s %12s %12s\n", "pool bytes", "entries",
+				"mean open ms", "max open ms");
+		for (int size = 0; size < nsizes; size++)
+			printf("%14" PRIu64 " %12" PRIu64 " %12.2f %12.2f\n",
+					sizes[size], entries[size],
+					open_sum[size] / nruns,
+					open_max[size]);
+	}
+
+	if (nbad != 0)
+		errx(1, "%" PRIu64 " counts wrong", nbad);
+
+	exit(0);
+}
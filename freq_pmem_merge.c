@@ -0,0 +1,54 @@
+/*
+ * freq_pmem_merge.c -- add the word counts in one pmem pool to another
+ *
+ * the source pool is only read; the destination gets a table if it has
+ * none.  Buckets are merged in ranges, in parallel, one thread a CPU by
+ * default, and a merge that is interrupted picks up where it stopped
+ * when run again with the same pools, without counting anything twice.
+ * Nothing else may have either pool open meanwhile.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "libfreq_pmem.h"
+
+void usage(const char *cmd)
+{
+	fprintf(stderr, "usage: %s [-t threads] srcpool dstpool\n", cmd);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	long nthreads = 0;
+	int c;
+
+	while ((c = getopt(argc, argv, "t:")) != -1)
+		switch (c) {
+		case 't':
+			nthreads = atol(optarg);
+			if (nthreads < 1)
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+
+	if (optind != argc - 2)
+		usage(argv[0]);
+
+	if (nthreads == 0 && (nthreads = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		nthreads = 1;
+
+	struct freq_table *src = freq_pmem_open(argv[optind],
+			FREQ_PMEM_RDONLY);
+	struct freq_table *dst = freq_pmem_open(argv[optind + 1],
+			FREQ_PMEM_CREATE);
+
+	freq_pmem_merge(dst, src, nthreads);
+
+	freq_close(dst);
+	freq_close(src);
+	exit(0);
+}
@@ -1,88 +1,59 @@
 /*
  * freq_pmem_print.c -- print word frequency counts from pmem file
+ *
+ * with -o the counts go to a run file instead, a portable snapshot of
+ * the table that freq_pmem -i adds to a pool on any machine; -j sets
+ * how many parts it is written in, in parallel, one per CPU by default.
+ * The pool is only read; one whose table has an older layout must be
+ * opened by freq_pmem first, which migrates it.
  */
-#include <ctype.h>
-#include <err.h>
-#include <errno.h>
-#include <libpmemobj.h>
-#include <pthread.h>
-#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <string.h>
 #include <unistd.h>
 
-/* declare all the types used in the layout of our pmempool file */
-POBJ_LAYOUT_BEGIN(freq);
-POBJ_LAYOUT_ROOT(freq, struct root);
-POBJ_LAYOUT_TOID(freq, struct entry);
-POBJ_LAYOUT_TOID(freq, char);
-POBJ_LAYOUT_TOID(freq, struct bucket);
-POBJ_LAYOUT_END(freq);
+#include "libfreq_pmem.h"
 
-/* root object definition */
-struct root {
-	TOID(struct bucket) h;	/* hash table for word frequencies */
-	/* ... OIDs for other things we store in this pool go here... */
-};
-
-#define NBUCKETS 10007
-
-/* entries in a bucket are a linked list of struct entry */
-struct entry {
-	TOID(struct entry) next;
-	TOID(char) word;
-	PMEMmutex mutex;		/* protects count field */
-	int count;
-};
-
-/* each bucket contains a pointer to the linked list of entries */
-struct bucket {
-	PMEMrwlock rwlock;		/* protects entries field */
-	TOID(struct entry) entries;
-};
-
-PMEMobjpool *Pop;	/* pmemobj pool pointer */
-struct bucket *H;	/* run-time pointer to H[] in pmem */
-
-
-/* print all entries in the hash table */
-void print_counts()
+void usage(const char *cmd)
 {
-	for (int i = 0; i < NBUCKETS; i++) {
-		TOID(struct entry) ep = H[i].entries;
-
-		for (; !TOID_IS_NULL(ep); ep = D_RW(ep)->next)
-			printf("%d %s\n", D_RO(ep)->count,
-						D_RO(D_RO(ep)->word));
-	}
+	fprintf(stderr, "usage: %s [-o snapshot [-j parts]] pmemfile\n", cmd);
+	exit(1);
 }
 
 int main(int argc, char *argv[])
 {
-	if (argc != 2) {
-		fprintf(stderr, "usage: %s pmemfile\n", argv[0]);
-		exit(1);
-	}
-
-	Pop = pmemobj_open(argv[1], POBJ_LAYOUT_NAME(freq));
-
-	if (Pop == NULL)
-		err(1, "pmemobj_open: %s", argv[1]);
-
-	TOID(struct root) root = POBJ_ROOT(Pop, struct root);
-
-	/* before starting, see if buckets have been allocated */
-	if (TOID_IS_NULL(D_RW(root)->h)) {
-		/* nope, treat like empty table */
-		exit(0);
-	}
-
-	/* get run-time pointer to hash table */
-	H = D_RW(D_RW(root)->h);
-
-	print_counts();
-
-	pmemobj_close(Pop);
+	const char *snapshot = NULL;
+	long nparts = 0;
+	int c;
+
+	while ((c = getopt(argc, argv, "j:o:")) != -1)
+		switch (c) {
+		case 'j':
+			nparts = atol(optarg);
+			if (nparts < 1 || nparts > FREQ_MAXPARTS)
+				usage(argv[0]);
+			break;
+		case 'o':
+			snapshot = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+
+	if (optind != argc - 1 || (nparts != 0 && snapshot == NULL))
+		usage(argv[0]);
+
+	/* never writes, a pool from an older version is left to freq_pmem */
+	struct freq_table *t = freq_pmem_open(argv[optind], FREQ_PMEM_RDONLY);
+
+	if (snapshot != NULL) {
+		if (nparts == 0 && (nparts = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+			nparts = 1;
+		if (nparts > FREQ_MAXPARTS)
+			nparts = FREQ_MAXPARTS;
+		freq_run_write(t, snapshot, nparts);
+	} else
+		freq_print(t);
+
+	freq_close(t);
 	exit(0);
 }
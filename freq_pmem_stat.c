@@ -0,0 +1,80 @@
+/*
+ * freq_pmem_stat.c -- show how a freq pool's space is used
+ *
+ * reports what the table holds, what libpmemobj's heap statistics say
+ * is allocated and how fragmented its runs are, the allocations in the
+ * pool by usable size, which stands in for their allocation classes,
+ * and how much of the allocated space is slack.  With -c the table is
+ * compacted first, rewriting its entries bucket by bucket into adjacent
+ * allocations, and the report shows the pool afterwards.  Nothing else
+ * may have the pool open meanwhile.
+ */
+#include <err.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "libfreq_pmem.h"
+
+void usage(const char *cmd)
+{
+	fprintf(stderr, "usage: %s [-c] pmemfile\n", cmd);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	struct freq_pmem_usage u;
+	struct freq_stats st;
+	int compact = 0;
+	int c;
+
+	while ((c = getopt(argc, argv, "c")) != -1)
+		switch (c) {
+		case 'c':
+			compact++;
+			break;
+		default:
+			usage(argv[0]);
+		}
+
+	if (optind != argc - 1)
+		usage(argv[0]);
+
+	struct freq_table *t = freq_pmem_open(argv[optind], 0);
+
+	if (compact)
+		freq_pmem_compact(t);
+
+	freq_pmem_stats(t, &st);
+	freq_pmem_usage(t, &u);
+
+	uint64_t total = freq_stats_total(&st);
+
+	printf("%" PRIu64 " entries, %" PRIu64 " bytes of words\n",
+			st.entries, st.word_bytes);
+	printf("%" PRIu64 " bytes in the table, %" PRIu64 " of them slack "
+			"and headers (%.1f%%)\n", total, st.overhead_bytes,
+			total ? 100.0 * st.overhead_bytes / total : 0.0);
+	printf("%" PRIu64 " bytes in %" PRIu64 " allocations, %" PRIu64
+			" allocated in the heap\n", u.bytes, u.nallocs,
+			u.heap_allocated);
+	printf("%" PRIu64 " bytes in runs, %" PRIu64 " of them allocated, "
+			"%.1f%% fragmentation\n", u.run_active,
+			u.run_allocated, u.run_active > u.run_allocated ?
+			100.0 * (u.run_active - u.run_allocated) /
+			u.run_active : 0.0);
+
+	printf("by usable size, approximating allocation classes:\n");
+	printf("%10s %12s %14s\n", "size", "allocations", "bytes");
+	for (size_t i = 0; i < u.nsizes; i++)
+		printf("%10" PRIu64 " %12" PRIu64 " %14" PRIu64 "\n",
+				u.sizes[i].size, u.sizes[i].count,
+				u.sizes[i].size * u.sizes[i].count);
+	if (u.other_count != 0)
+		printf("%10s %12" PRIu64 "\n", "other", u.other_count);
+
+	freq_close(t);
+	exit(0);
+}
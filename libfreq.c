@@ -0,0 +1,730 @@
+/*
+ * libfreq.c -- hash function and tokenizer shared by all backends
+ */
+#include <ctype.h>
+#include <err.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "libfreq.h"
+#include "lockword.h"
+
+/* hash a string into an index into a table of FREQ_NBUCKETS buckets */
+unsigned freq_hash(const char *s)
+{
+	unsigned h = FREQ_NBUCKETS ^ ((unsigned)*s++ << 2);
+	unsigned len = 0;
+
+	while (*s) {
+		len++;
+		h ^= (((unsigned)*s) << (len % 3)) +
+		    ((unsigned)*(s - 1) << ((len % 3 + 7)));
+		s++;
+	}
+	h ^= len;
+
+	return h % FREQ_NBUCKETS;
+}
+
+/* 64-bit FNV-1a hash of len bytes, for tables that outgrow freq_hash() */
+uint64_t freq_hash64(const char *s, size_t len)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	while (len--) {
+		h ^= (unsigned char)*s++;
+		h *= 0x100000001b3ULL;
+	}
+
+	return h;
+}
+
+/* look up a profile by name ("alpha", "alnum", ...), -1 if unknown */
+int freq_profile_parse(const char *name)
+{
+	if (strcmp(name, "alpha") == 0)
+		return FREQ_PROFILE_ALPHA;
+	if (strcmp(name, "alnum") == 0)
+		return FREQ_PROFILE_ALNUM;
+	if (strcmp(name, "word") == 0)
+		return FREQ_PROFILE_WORD;
+	if (strcmp(name, "latin1") == 0)
+		return FREQ_PROFILE_LATIN1;
+	return -1;
+}
+
+/* apply tokenizer option c (from FREQ_TOKOPTS) to opts, -1 if invalid */
+int freq_tokopt(struct freq_tokopts *opts, int c, const char *arg)
+{
+	int profile;
+
+	switch (c) {
+	case 'f':
+		opts->fold = 1;
+		return 0;
+	case 'u':
+		opts->utf8 = 1;
+		return 0;
+	case 's':
+		opts->stopfile = arg;
+		return 0;
+	case 'S':
+		opts->stopbuiltin = 1;
+		return 0;
+	case 'w':
+		if ((profile = freq_profile_parse(arg)) < 0)
+			return -1;
+		opts->profile = profile;
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+/* copy n bytes of a word, folding them to lower case on the way */
+static void fold_copy(char *dst, const unsigned char *src, size_t n)
+{
+	size_t i = 0;
+
+#ifdef __SSE2__
+	/* 'A' + 0x3f wraps to -128 as a signed byte, 'Z' to -103 */
+	const __m128i bias = _mm_set1_epi8(0x3f);
+	const __m128i limit = _mm_set1_epi8(-128 + 26);
+	const __m128i delta = _mm_set1_epi8(0x20);
+
+	for (; i + 16 <= n; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+
+		/* anything outside ASCII goes through the table below */
+		if (_mm_movemask_epi8(v) != 0) {
+			for (size_t j = i; j < i + 16; j++)
+				dst[j] = freq_fold[src[j]];
+			continue;
+		}
+
+		__m128i upper = _mm_cmplt_epi8(_mm_add_epi8(v, bias), limit);
+		v = _mm_add_epi8(v, _mm_and_si128(upper, delta));
+		_mm_storeu_si128((__m128i *)(dst + i), v);
+	}
+#endif
+
+	for (; i < n; i++)
+		dst[i] = freq_fold[src[i]];
+}
+
+#define BUFSIZE 65536
+
+/* hand a finished word of len bytes to fn, unless it is a stopword */
+static inline void emit(char *word, size_t len,
+		const struct freq_stopwords *sw, freq_word_fn fn, void *arg)
+{
+	word[len] = '\0';
+	if (sw == NULL || !freq_is_stopword(sw, word, len))
+		fn(word, arg);
+}
+
+/* break a file of single-byte characters into words */
+static void tokenize_bytes(FILE *fp, const char *fname, unsigned mask,
+		int fold, const struct freq_stopwords *sw, freq_word_fn fn,
+		void *arg)
+{
+	unsigned char buf[BUFSIZE];
+	char word[FREQ_MAXWORD];
+	size_t len = 0;		/* length of the word in progress, 0 if none */
+	size_t n;
+
+	while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+		size_t i = 0;
+
+		while (i < n) {
+			/* find the run of word bytes starting at i */
+			size_t j = i;
+
+			while (j < n && (freq_ctype[buf[j]] & mask))
+				j++;
+
+			while (i < j) {
+				/* add as much of the run as fits to the word */
+				size_t room = FREQ_MAXWORD - 1 - len;
+				size_t chunk = j - i < room ? j - i : room;
+
+				if (fold)
+					fold_copy(&word[len], &buf[i], chunk);
+				else
+					memcpy(&word[len], &buf[i], chunk);
+				len += chunk;
+				i += chunk;
+
+				if (i < j) {
+					/* word too long, truncate it */
+					emit(word, len, sw, fn, arg);
+					len = 0;
+					i++;
+				}
+			}
+
+			if (j == n)
+				break;	/* word may go on in the next block */
+
+			if (len != 0) {
+				/* word ended, store it */
+				emit(word, len, sw, fn, arg);
+				len = 0;
+			}
+
+			/* skip to the start of the next word */
+			while (i < n && !(freq_ctype[buf[i]] & mask))
+				i++;
+		}
+	}
+
+	if (ferror(fp))
+		err(1, "read: %s", fname);
+
+	/* handle the last word */
+	if (len != 0) {
+		/* word ended, store it */
+		emit(word, len, sw, fn, arg);
+	}
+}
+
+/*
+ * length of the UTF-8 sequence at s, of which n bytes are available, with
+ * its code point in *cp; 0 if the sequence runs past the n bytes, 1 with
+ * *cp set to -1 if s doesn't start a valid (shortest form) sequence
+ */
+static size_t utf8_decode(const unsigned char *s, size_t n, long *cp)
+{
+	unsigned c = s[0];
+	unsigned lo = 0x80, hi = 0xbf;	/* valid range of the second byte */
+	unsigned long v;
+	size_t len;
+
+	if (c < 0x80) {
+		*cp = c;
+		return 1;
+	} else if (c < 0xc2) {
+		goto bad;
+	} else if (c < 0xe0) {
+		len = 2;
+		v = c & 0x1f;
+	} else if (c < 0xf0) {
+		len = 3;
+		v = c & 0x0f;
+		if (c == 0xe0)
+			lo = 0xa0;	/* overlong */
+		else if (c == 0xed)
+			hi = 0x9f;	/* surrogates */
+	} else if (c < 0xf5) {
+		len = 4;
+		v = c & 0x07;
+		if (c == 0xf0)
+			lo = 0x90;	/* overlong */
+		else if (c == 0xf4)
+			hi = 0x8f;	/* above U+10FFFF */
+	} else {
+		goto bad;
+	}
+
+	for (size_t i = 1; i < len; i++) {
+		if (i >= n)
+			return 0;
+		if (s[i] < lo || s[i] > hi)
+			goto bad;
+		v = (v << 6) | (s[i] & 0x3f);
+		lo = 0x80;
+		hi = 0xbf;
+	}
+
+	*cp = v;
+	return len;
+
+bad:
+	*cp = -1;
+	return 1;
+}
+
+/* word being put together by tokenize_utf8() */
+struct wordbuf {
+	char word[FREQ_MAXWORD];
+	size_t len;		/* 0 if there is no word in progress */
+	const struct freq_stopwords *sw;
+	freq_word_fn fn;
+	void *arg;
+};
+
+/* end the word in progress, if any, and hand it to fn */
+static inline void word_end(struct wordbuf *wb)
+{
+	if (wb->len != 0) {
+		emit(wb->word, wb->len, wb->sw, wb->fn, wb->arg);
+		wb->len = 0;
+	}
+}
+
+/* add the n bytes of one character to the word in progress */
+static inline void word_add(struct wordbuf *wb, const unsigned char *s,
+		size_t n, int fold)
+{
+	char *d = &wb->word[wb->len];
+
+	if (wb->len + n > FREQ_MAXWORD - 1) {
+		/* word too long, truncate it and drop the character */
+		word_end(wb);
+		return;
+	}
+
+	wb->len += n;
+
+	if (!fold) {
+		memcpy(d, s, n);
+	} else if (n == 1) {
+		d[0] = freq_fold[s[0]];
+	} else if (n == 2 && s[0] == 0xc3 && s[1] <= 0x9e && s[1] != 0x97) {
+		/* U+00C0-U+00DE, the ISO 8859-1 upper case letters */
+		d[0] = s[0];
+		d[1] = s[1] + 0x20;
+	} else {
+		memcpy(d, s, n);
+	}
+}
+
+/*
+ * break a UTF-8 file into words; ASCII is classified with freq_ctype[]
+ * and everything else is decoded and classified with freq_uclass(),
+ * invalid sequences end a word like any other delimiter
+ */
+static void tokenize_utf8(FILE *fp, const char *fname, unsigned mask,
+		int fold, const struct freq_stopwords *sw, freq_word_fn fn,
+		void *arg)
+{
+	unsigned char buf[BUFSIZE];
+	struct wordbuf wb = { .len = 0, .sw = sw, .fn = fn, .arg = arg };
+	size_t have = 0;	/* bytes in buf */
+	int eof = 0;
+
+	while (!eof) {
+		size_t n = fread(buf + have, 1, sizeof(buf) - have, fp);
+		size_t i = 0;
+
+		if (n == 0) {
+			if (ferror(fp))
+				err(1, "read: %s", fname);
+			eof = 1;
+		}
+		have += n;
+
+		while (i < have) {
+#ifdef __SSE2__
+			/* 16 bytes of plain ASCII need no decoding at all */
+			if (i + 16 <= have && _mm_movemask_epi8(_mm_loadu_si128(
+					(const __m128i *)(buf + i))) == 0) {
+				for (size_t end = i + 16; i < end; i++)
+					if (freq_ctype[buf[i]] & mask)
+						word_add(&wb, &buf[i], 1, fold);
+					else
+						word_end(&wb);
+				continue;
+			}
+#endif
+			if (buf[i] < 0x80) {
+				if (freq_ctype[buf[i]] & mask)
+					word_add(&wb, &buf[i], 1, fold);
+				else
+					word_end(&wb);
+				i++;
+				continue;
+			}
+
+			long cp;
+			size_t len = utf8_decode(&buf[i], have - i, &cp);
+
+			if (len == 0) {
+				if (!eof)
+					break;	/* finish it after next read */
+				len = 1;	/* cut off by end of file */
+				cp = -1;
+			}
+
+			if (cp >= 0 && (freq_uclass(cp) & mask))
+				word_add(&wb, &buf[i], len, fold);
+			else
+				word_end(&wb);
+			i += len;
+		}
+
+		/* carry a sequence cut off by the end of the block over */
+		memmove(buf, &buf[i], have - i);
+		have -= i;
+	}
+
+	/* handle the last word */
+	word_end(&wb);
+}
+
+/* break a text file into words and call fn on each one */
+void freq_tokenize_file(const char *fname, const struct freq_tokopts *opts,
+		freq_word_fn fn, void *arg)
+{
+	FILE *fp;
+	unsigned mask = opts ? opts->profile : FREQ_PROFILE_ALPHA;
+	int fold = opts ? opts->fold : 0;
+	const struct freq_stopwords *sw = opts ? opts->stopwords : NULL;
+
+	if ((fp = fopen(fname, "r")) == NULL)
+		err(1, "fopen: %s", fname);
+
+	if (opts && opts->utf8)
+		tokenize_utf8(fp, fname, mask, fold, sw, fn, arg);
+	else
+		tokenize_bytes(fp, fname, mask, fold, sw, fn, arg);
+
+	fclose(fp);
+}
+
+/* see libfreq.h */
+unsigned freq_prefetch = 16;
+
+#if FREQ_NBUCKETS > (1 << 14)
+#error "sort_bwords() only sorts 14-bit bucket numbers"
+#endif
+
+/* radix sort n words by bucket, 7 bits at a time through tmp */
+static void sort_bwords(struct freq_bword *w, struct freq_bword *tmp,
+		size_t n)
+{
+	struct freq_bword *from = w, *to = tmp;
+
+	/* two passes cover FREQ_NBUCKETS < 1 << 14 and end up back in w */
+	for (int shift = 0; shift < 14; shift += 7) {
+		size_t start[129] = { 0 };
+
+		for (size_t i = 0; i < n; i++)
+			start[((from[i].h >> shift) & 127) + 1]++;
+		for (int b = 0; b < 128; b++)
+			start[b + 1] += start[b];
+		for (size_t i = 0; i < n; i++)
+			to[start[(from[i].h >> shift) & 127]++] = from[i];
+
+		from = to;
+		to = w;
+	}
+}
+
+int freq_set_max_entries(struct freq_table *t, uint64_t max)
+{
+	if (t->ops->prune == NULL || t->ops->size == NULL)
+		return -1;
+
+	t->max_entries = max;
+	return 0;
+}
+
+int freq_set_max_memory(struct freq_table *t, uint64_t max)
+{
+	if (t->ops->prune == NULL || t->ops->size == NULL ||
+	    t->ops->stats == NULL)
+		return -1;
+
+	t->max_bytes = max;
+	return 0;
+}
+
+/* true if t has gone over either of its limits */
+static int over_limits(struct freq_table *t)
+{
+	struct freq_stats st;
+
+	if (t->max_entries != 0 && t->ops->size(t) > t->max_entries)
+		return 1;
+
+	if (t->max_bytes == 0)
+		return 0;
+
+	t->ops->stats(t, &st);
+	return freq_stats_total(&st) > t->max_bytes;
+}
+
+/*
+ * entries t has to be pruned down to to be under three quarters of its
+ * limits; for memory, entries are taken to cost what they do on average
+ * and the buckets to stay as they are
+ */
+static uint64_t target_size(struct freq_table *t)
+{
+	uint64_t target = UINT64_MAX;
+	struct freq_stats st;
+
+	if (t->max_entries != 0)
+		target = t->max_entries - t->max_entries / 4;
+
+	if (t->max_bytes != 0) {
+		uint64_t goal = t->max_bytes - t->max_bytes / 4;
+		uint64_t var, n = 0;
+
+		t->ops->stats(t, &st);
+		var = freq_stats_total(&st) - st.bucket_bytes;
+		if (goal > st.bucket_bytes && var != 0)
+			n = (double)st.entries * (goal - st.bucket_bytes) / var;
+		if (n < target)
+			target = n;
+	}
+
+	return target;
+}
+
+/*
+ * prune t back under three quarters of its limits, lowest counts first;
+ * a word pruned at a threshold of min lost at most min - 1 counts, and
+ * one that came back can be pruned again, so the error adds up.  Other
+ * threads may be adding entries meanwhile, so only as many as were over
+ * to begin with are pruned, the next batch over the limit does the rest.
+ * If another thread is already pruning, counting just goes on
+ */
+static void shrink(struct freq_table *t)
+{
+	uint64_t target, size;
+
+	if (!freq_trylock(&t->pruning))
+		return;
+
+	target = target_size(t);
+
+	if ((size = t->ops->size(t)) > target) {
+		uint64_t need = size - target;
+
+		for (uint64_t min = 2; ; min *= 2) {
+			uint64_t n = t->ops->prune(t, min);
+
+			if (n != 0) {
+				__atomic_add_fetch(&t->pruned, n,
+						__ATOMIC_RELAXED);
+				__atomic_add_fetch(&t->error, min - 1,
+						__ATOMIC_RELAXED);
+			}
+
+			/* or everything left is counted too often to tell */
+			if (n >= need || min > UINT64_MAX / 2)
+				break;
+			need -= n;
+		}
+	}
+
+	freq_unlock(&t->pruning);
+}
+
+/* count n words, grouped by bucket for the backend */
+void freq_count_batch(struct freq_table *t, const char *const *words,
+		const size_t *lens, size_t n)
+{
+	struct freq_bword tmp[FREQ_BATCH], w[FREQ_BATCH];
+
+	if (t->ops->count_batch == NULL) {
+		for (size_t i = 0; i < n; i++)
+			freq_add(t, words[i], 1);
+		goto out;
+	}
+
+	for (size_t base = 0; base < n; base += FREQ_BATCH) {
+		size_t m = n - base < FREQ_BATCH ? n - base : FREQ_BATCH;
+		size_t k = 0, group = 0;
+
+		for (size_t i = 0; i < m; i++) {
+			w[i].word = words[base + i];
+			w[i].len = lens[base + i];
+			w[i].h = freq_hash(w[i].word);
+			w[i].n = 1;
+		}
+
+		sort_bwords(w, tmp, m);
+
+		/* fold repeated words into one with a count */
+		for (size_t i = 0; i < m; i++) {
+			size_t j;
+
+			if (k == 0 || w[i].h != w[k - 1].h)
+				group = k;	/* first word of a new bucket */
+
+			for (j = group; j < k; j++)
+				if (w[j].len == w[i].len &&
+				    memcmp(w[j].word, w[i].word, w[i].len) == 0)
+					break;
+
+			if (j < k)
+				w[j].n++;
+			else
+				w[k++] = w[i];
+		}
+
+		t->ops->count_batch(t, w, k);
+	}
+out:
+	if ((t->max_entries != 0 || t->max_bytes != 0) && over_limits(t)) {
+		if (t->spill != NULL)
+			freq_spill(t);
+		else
+			shrink(t);
+	}
+}
+
+/* words gathered by freq_count_file() for freq_count_batch() */
+struct countbuf {
+	struct freq_table *t;
+	size_t n;			/* words gathered */
+	size_t used;			/* bytes of buf in use */
+	const char *words[FREQ_BATCH];
+	size_t lens[FREQ_BATCH];
+	char buf[BUFSIZE];
+};
+
+static void countbuf_flush(struct countbuf *cb)
+{
+	freq_count_batch(cb->t, cb->words, cb->lens, cb->n);
+	cb->n = 0;
+	cb->used = 0;
+}
+
+/* freq_word_fn that gathers each word into the countbuf passed as arg */
+static void count_word(const char *word, void *arg)
+{
+	struct countbuf *cb = arg;
+	size_t len = strlen(word);
+
+	if (cb->n == FREQ_BATCH || cb->used + len + 1 > BUFSIZE)
+		countbuf_flush(cb);
+
+	cb->words[cb->n] = memcpy(cb->buf + cb->used, word, len + 1);
+	cb->lens[cb->n++] = len;
+	cb->used += len + 1;
+}
+
+/* tokenize a file, counting every word in table t */
+void freq_count_file(struct freq_table *t, const char *fname,
+		const struct freq_tokopts *opts)
+{
+	struct countbuf *cb;
+
+	if ((cb = malloc(sizeof(*cb))) == NULL)
+		err(1, "malloc");
+	cb->t = t;
+	cb->n = 0;
+	cb->used = 0;
+
+	freq_tokenize_file(fname, opts, count_word, cb);
+
+	countbuf_flush(cb);
+	free(cb);
+}
+
+uint64_t freq_stats_total(const struct freq_stats *st)
+{
+	return st->bucket_bytes + st->entry_bytes + st->word_bytes +
+			st->overhead_bytes;
+}
+
+void freq_print_stats(const char *cmd, const struct freq_stats *st)
+{
+	uint64_t total = freq_stats_total(st);
+
+	fprintf(stderr, "%s: %" PRIu64 " entries\n", cmd, st->entries);
+	fprintf(stderr, "%s: %" PRIu64 " bytes of buckets\n", cmd,
+			st->bucket_bytes);
+	fprintf(stderr, "%s: %" PRIu64 " bytes of entries\n", cmd,
+			st->entry_bytes);
+	fprintf(stderr, "%s: %" PRIu64 " bytes of words\n", cmd,
+			st->word_bytes);
+	fprintf(stderr, "%s: %" PRIu64 " bytes of allocator overhead\n", cmd,
+			st->overhead_bytes);
+	fprintf(stderr, "%s: %" PRIu64 " bytes in all, %.1f per entry\n",
+			cmd, total, st->entries ?
+			(double)total / st->entries : 0.0);
+}
+
+/*
+ * the decimal number s starts with into *np and what follows into *endp,
+ * -1 if it doesn't start with a digit or the number is too big
+ */
+static int parse_decimal(const char *s, char **endp, unsigned long long *np)
+{
+	/* strtoull() would take "-1" as the largest number there is */
+	if (!isdigit((unsigned char)*s))
+		return -1;
+
+	errno = 0;
+	*np = strtoull(s, endp, 10);
+
+	return errno == ERANGE ? -1 : 0;
+}
+
+int freq_parse_count(const char *s, uint64_t *np)
+{
+	char *end;
+	unsigned long long n;
+
+	if (parse_decimal(s, &end, &n) < 0 || *end != '\0')
+		return -1;
+
+	*np = n;
+	return 0;
+}
+
+int freq_parse_size(const char *s, uint64_t *sizep)
+{
+	char *end;
+	unsigned long long n;
+	int shift = 0;
+
+	if (parse_decimal(s, &end, &n) < 0)
+		return -1;
+
+	switch (*end) {
+	case 'g': case 'G':
+		shift += 10;
+		/* FALLTHROUGH */
+	case 'm': case 'M':
+		shift += 10;
+		/* FALLTHROUGH */
+	case 'k': case 'K':
+		shift += 10;
+		end++;
+	}
+
+	if (*end != '\0' || n > UINT64_MAX >> shift)
+		return -1;
+
+	*sizep = (uint64_t)n << shift;
+	return 0;
+}
+
+size_t freq_malloc_overhead(void *p, size_t n)
+{
+#ifdef __GLIBC__
+	/* glibc puts a size_t in front of every chunk */
+	return malloc_usable_size(p) - n + sizeof(size_t);
+#else
+	/* no way to ask, guess a chunk header and some rounding */
+	return 2 * sizeof(size_t);
+#endif
+}
+
+/* freq_walk_fn that prints one entry */
+static void print_entry(const char *word, uint64_t count, void *arg)
+{
+	printf("%" PRIu64 " %s\n", count, word);
+}
+
+/* print all entries in the table, one "count word" line each */
+void freq_print(struct freq_table *t)
+{
+	freq_spill_walk(t, print_entry, NULL);
+}
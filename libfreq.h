@@ -0,0 +1,393 @@
+/*
+ * libfreq.h -- word frequency counting library
+ *
+ * libfreq contains the pieces every freq program used to carry its own
+ * copy of: the hash function, the tokenizer, and the word table.  The
+ * word table is reached through a small backend interface so the same
+ * tokenizer can feed a single-threaded volatile table, a concurrent
+ * volatile table, or a table in a pmem pool (libfreq_pmem).
+ */
+#ifndef LIBFREQ_H
+#define LIBFREQ_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FREQ_NBUCKETS 10007
+
+/* size of a cache line, what shared data is aligned and padded to */
+#define FREQ_CACHELINE 64
+
+/* longest word handed to a backend, longer words are truncated */
+#define FREQ_MAXWORD 8192
+
+/* character classes, bits in freq_ctype[] */
+#define FREQ_C_ALPHA	0x1	/* ASCII letter */
+#define FREQ_C_DIGIT	0x2	/* ASCII digit */
+#define FREQ_C_APOS	0x4	/* apostrophe */
+#define FREQ_C_LATIN1	0x8	/* ISO 8859-1 letter above 0x7f */
+
+/*
+ * tokenizer profiles, which classes of bytes make up a word; a profile
+ * is the mask of the classes it accepts
+ */
+enum freq_profile {
+	FREQ_PROFILE_ALPHA = FREQ_C_ALPHA,	/* letters, the default */
+	FREQ_PROFILE_ALNUM = FREQ_C_ALPHA | FREQ_C_DIGIT,
+	FREQ_PROFILE_WORD = FREQ_C_ALPHA | FREQ_C_DIGIT | FREQ_C_APOS,
+	FREQ_PROFILE_LATIN1 = FREQ_C_ALPHA | FREQ_C_LATIN1,
+};
+
+struct freq_stopwords;
+
+/* tokenizer options, a NULL pointer means all defaults */
+struct freq_tokopts {
+	enum freq_profile profile;
+	int fold;		/* fold words to lower case as copied */
+	int utf8;		/* UTF-8 input, letters are Unicode ones */
+	const char *stopfile;	/* file of stopwords to drop */
+	int stopbuiltin;	/* drop the built-in stopwords */
+	struct freq_stopwords *stopwords; /* built by freq_tokopts_setup() */
+};
+
+/* getopt() letters for the tokenizer options, see freq_tokopt() */
+#define FREQ_TOKOPTS "fuw:s:S"
+#define FREQ_TOKOPTS_USAGE "[-f] [-u] [-w alpha|alnum|word|latin1] " \
+	"[-s|--stopwords file] [-S|--builtin-stopwords]"
+
+/* getopt_long() entries for the tokenizer options */
+#define FREQ_TOKOPTS_LONG \
+	{ "fold", no_argument, NULL, 'f' }, \
+	{ "utf8", no_argument, NULL, 'u' }, \
+	{ "profile", required_argument, NULL, 'w' }, \
+	{ "stopwords", required_argument, NULL, 's' }, \
+	{ "builtin-stopwords", no_argument, NULL, 'S' }
+
+/* class bits for each byte, independent of the process locale */
+extern const unsigned char freq_ctype[256];
+
+/* each byte mapped to its lower case equivalent, ASCII and ISO 8859-1 */
+extern const unsigned char freq_fold[256];
+
+/* Unicode class tables generated by mkutf8tab.py, see freq_uclass() */
+extern const unsigned char freq_ustage1[];
+extern const unsigned char freq_ustage2[][64];
+
+/*
+ * class bits for a Unicode code point: letters and combining marks are
+ * FREQ_C_ALPHA, decimal digits FREQ_C_DIGIT and U+2019 FREQ_C_APOS
+ */
+static inline unsigned freq_uclass(unsigned long cp)
+{
+	unsigned code = freq_ustage2[freq_ustage1[cp >> 8]][(cp & 0xff) >> 2];
+
+	code = (code >> ((cp & 3) * 2)) & 3;
+
+	/* 2-bit codes 0, 1, 2, 3 are class bits 0, 0x1, 0x2, 0x4 */
+	return (1u << code) >> 1;
+}
+
+struct freq_table;
+
+/* most words freq_count_batch() hands a backend at once */
+#define FREQ_BATCH 256
+
+/* a distinct word of a batch, see freq_count_batch() */
+struct freq_bword {
+	const char *word;
+	size_t len;		/* strlen(word) */
+	unsigned h;		/* freq_hash(word) */
+	uint64_t n;		/* times it occurs in the batch */
+};
+
+/* memory a table takes, see freq_stats() */
+struct freq_stats {
+	uint64_t entries;
+	uint64_t bucket_bytes;		/* bucket arrays */
+	uint64_t entry_bytes;		/* entries, without their words */
+	uint64_t word_bytes;		/* words, NULs included */
+	uint64_t overhead_bytes;	/* allocator headers and padding */
+};
+
+/* called once per word by freq_tokenize_file() */
+typedef void (*freq_word_fn)(const char *word, void *arg);
+
+/* called once per entry by freq_walk() */
+typedef void (*freq_walk_fn)(const char *word, uint64_t count, void *arg);
+
+/* operations every backend implements */
+struct freq_ops {
+	const char *name;
+
+	/* bump the count for a word */
+	void (*count)(struct freq_table *t, const char *word);
+
+	/* add n to the count for a word, saturating instead of wrapping */
+	void (*add)(struct freq_table *t, const char *word, uint64_t n);
+
+	/*
+	 * add the counts of n <= FREQ_BATCH distinct words sorted by
+	 * bucket, so words in the same bucket are adjacent; optional,
+	 * without it freq_count_batch() calls add() for each word
+	 */
+	void (*count_batch)(struct freq_table *t, const struct freq_bword *w,
+			size_t n);
+
+	/*
+	 * remove every entry counted fewer than min times, returns how
+	 * many went; optional, tables without it keep everything
+	 */
+	uint64_t (*prune)(struct freq_table *t, uint64_t min);
+
+	/* number of entries in the table, needed along with prune */
+	uint64_t (*size)(struct freq_table *t);
+
+	/*
+	 * fill in how much memory the table takes, cheaply enough to be
+	 * called after every batch; optional
+	 */
+	void (*stats)(struct freq_table *t, struct freq_stats *st);
+
+	/* call fn for every entry in the table */
+	void (*walk)(struct freq_table *t, freq_walk_fn fn, void *arg);
+
+	/*
+	 * call fn for every entry whose freq_hash() % nparts is part,
+	 * from any number of threads at once; optional, with it
+	 * freq_run_write() writes the parts of a run in parallel
+	 */
+	void (*walk_part)(struct freq_table *t, unsigned part, unsigned nparts,
+			freq_walk_fn fn, void *arg);
+
+	/* release the table and everything it holds */
+	void (*close)(struct freq_table *t);
+};
+
+/* every backend's table starts with this */
+struct freq_table {
+	const struct freq_ops *ops;
+
+	/* see freq_set_max_entries(), zeroed by every backend */
+	uint64_t max_entries;		/* 0 for no limit */
+	uint64_t max_bytes;		/* likewise, freq_set_max_memory() */
+	uint64_t pruned;		/* entries pruned to keep to it */
+	uint64_t error;			/* most any count may be short by */
+	uint32_t pruning;		/* lock word held while pruning */
+	struct freq_spill *spill;	/* see freq_set_spill() */
+};
+
+/* hash a string into an index into a table of FREQ_NBUCKETS buckets */
+unsigned freq_hash(const char *s);
+
+/* 64-bit FNV-1a hash of len bytes, for tables that outgrow freq_hash() */
+uint64_t freq_hash64(const char *s, size_t len);
+
+/* look up a profile by name ("alpha", "alnum", ...), -1 if unknown */
+int freq_profile_parse(const char *name);
+
+/* apply tokenizer option c (from FREQ_TOKOPTS) to opts, -1 if invalid */
+int freq_tokopt(struct freq_tokopts *opts, int c, const char *arg);
+
+/* finish setting up options parsed by freq_tokopt(), loads stopwords */
+void freq_tokopts_setup(struct freq_tokopts *opts);
+
+/* build a stopword set from n words, duplicates are allowed */
+struct freq_stopwords *freq_stopwords_create(const char *const *words,
+		size_t n);
+
+/* true if the len bytes at word are in the set */
+int freq_is_stopword(const struct freq_stopwords *sw, const char *word,
+		size_t len);
+
+void freq_stopwords_free(struct freq_stopwords *sw);
+
+/* break a text file into words and call fn on each one */
+void freq_tokenize_file(const char *fname, const struct freq_tokopts *opts,
+		freq_word_fn fn, void *arg);
+
+/*
+ * how many lookups a count_batch() op keeps in flight: the volatile
+ * tables interleave that many chain walks, prefetching each one's next
+ * entry while the others take a step; the concurrent table, which looks
+ * words up one at a time without locks, prefetches bucket heads and
+ * first entries that many words ahead.  0 turns prefetching off
+ */
+extern unsigned freq_prefetch;
+
+/*
+ * count n NUL-terminated words, lens[i] is strlen(words[i]); the words
+ * are hashed and grouped by bucket first so a backend can look each
+ * bucket up, and lock it, once per batch instead of once per word
+ */
+void freq_count_batch(struct freq_table *t, const char *const *words,
+		const size_t *lens, size_t n);
+
+/*
+ * keep the number of entries freq_count_batch() leaves in t to about
+ * max, 0 for no limit.  Whenever a batch takes t over max, entries with
+ * the lowest counts are pruned until it is back under three quarters of
+ * it, trying counts below 2, then 4, 8 and so on.  Every count is then
+ * short by at most freq_error() of the true one, which is also as many
+ * times as a word that isn't in the table at all can have been seen.
+ * Returns -1 if t can't prune
+ */
+int freq_set_max_entries(struct freq_table *t, uint64_t max);
+
+/*
+ * as freq_set_max_entries(), but keep the memory freq_stats() counts
+ * to about max bytes; -1 if t can't prune or can't say what it takes
+ */
+int freq_set_max_memory(struct freq_table *t, uint64_t max);
+
+/* most parts a run file can be split into */
+#define FREQ_MAXPARTS 256
+
+/*
+ * write every entry of t to a new run file at path, sorted by word and
+ * split into nparts parts by hash, see spill.c for the format; tables
+ * that can walk a part at a time have their parts written in parallel
+ */
+void freq_run_write(struct freq_table *t, const char *path, unsigned nparts);
+
+/* most run files freq_run_merge() has open at once, in all threads */
+#define FREQ_MAXOPEN 256
+
+/*
+ * call fn once for every word in nruns run files with the sum of its
+ * counts, merging the runs part by part in up to nthreads threads, or
+ * as many as keep FREQ_MAXOPEN files open, so nruns may be at most
+ * that; fn is called from all of them, but never from two at once
+ */
+void freq_run_merge(const char *const *paths, int nruns, unsigned nthreads,
+		freq_walk_fn fn, void *arg);
+
+/*
+ * instead of pruning when t goes over its limits, write it out as a run
+ * in nparts parts (0 for one per CPU) in dir and start again empty;
+ * printing it merges the runs, in parallel over the parts, and closing
+ * it removes them.  Only for tables counted into by one thread at a
+ * time.  -1 if t can't
+ */
+int freq_set_spill(struct freq_table *t, const char *dir, unsigned nparts);
+
+/* write t out as a run now */
+void freq_spill(struct freq_table *t);
+
+/* freq_walk() for a table that may have spilled, calls fn as above */
+void freq_spill_walk(struct freq_table *t, freq_walk_fn fn, void *arg);
+
+/* remove the runs of t, called by freq_close() */
+void freq_spill_close(struct freq_table *t);
+
+/* bytes of memory a freq_stats() counts in all */
+uint64_t freq_stats_total(const struct freq_stats *st);
+
+/* print stats to stderr a line per field, each prefixed by "cmd: " */
+void freq_print_stats(const char *cmd, const struct freq_stats *st);
+
+/* parse a decimal count such as 100000 into *np, -1 if bad */
+int freq_parse_count(const char *s, uint64_t *np);
+
+/* parse a size such as 4096, 64k, 512M or 2G into *sizep, -1 if bad */
+int freq_parse_size(const char *s, uint64_t *sizep);
+
+/*
+ * bytes malloc() really took for the n bytes at p beyond those n: its
+ * chunk header and rounding; for backends keeping freq_stats.  Outside
+ * glibc this is a fixed guess per allocation
+ */
+size_t freq_malloc_overhead(void *p, size_t n);
+
+/* tokenize a file, counting every word in table t */
+void freq_count_file(struct freq_table *t, const char *fname,
+		const struct freq_tokopts *opts);
+
+/* print all entries in the table, one "count word" line each */
+void freq_print(struct freq_table *t);
+
+/* freq_volatile_create() flags */
+#define FREQ_COMPACT	0x1	/* 32-bit counts that spill to 64 bits */
+
+/* single-threaded table in DRAM */
+struct freq_table *freq_volatile_create(int flags);
+
+/* table in DRAM safe for concurrent count() calls */
+struct freq_table *freq_concurrent_create(void);
+
+static inline void freq_count(struct freq_table *t, const char *word)
+{
+	t->ops->count(t, word);
+}
+
+static inline void freq_add(struct freq_table *t, const char *word,
+		uint64_t n)
+{
+	t->ops->add(t, word, n);
+}
+
+/* drop entries counted fewer than min times, returns how many */
+static inline uint64_t freq_prune(struct freq_table *t, uint64_t min)
+{
+	return t->ops->prune != NULL ? t->ops->prune(t, min) : 0;
+}
+
+/* entries in t, 0 if it doesn't say */
+static inline uint64_t freq_size(struct freq_table *t)
+{
+	return t->ops->size != NULL ? t->ops->size(t) : 0;
+}
+
+/* fill in st for t, all zeroes if it doesn't say */
+static inline void freq_stats(struct freq_table *t, struct freq_stats *st)
+{
+	struct freq_stats zero = { 0 };
+
+	*st = zero;
+	if (t->ops->stats != NULL)
+		t->ops->stats(t, st);
+}
+
+/* add the stats in b to those in a */
+static inline void freq_stats_add(struct freq_stats *a,
+		const struct freq_stats *b)
+{
+	a->entries += b->entries;
+	a->bucket_bytes += b->bucket_bytes;
+	a->entry_bytes += b->entry_bytes;
+	a->word_bytes += b->word_bytes;
+	a->overhead_bytes += b->overhead_bytes;
+}
+
+/* most any count of t may be short by, because of pruning */
+static inline uint64_t freq_error(struct freq_table *t)
+{
+	return __atomic_load_n(&t->error, __ATOMIC_RELAXED);
+}
+
+static inline void freq_walk(struct freq_table *t, freq_walk_fn fn, void *arg)
+{
+	t->ops->walk(t, fn, arg);
+}
+
+static inline void freq_close(struct freq_table *t)
+{
+	if (t->spill != NULL)
+		freq_spill_close(t);
+	t->ops->close(t);
+}
+
+/* a + b, or UINT64_MAX if that doesn't fit */
+static inline uint64_t freq_sat_add(uint64_t a, uint64_t b)
+{
+	return a + b < a ? UINT64_MAX : a + b;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
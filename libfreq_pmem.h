@@ -0,0 +1,99 @@
+/*
+ * libfreq_pmem.h -- pmem backend for libfreq, link with -lfreq_pmem
+ *
+ * create the pool for this backend using pmempool, for example:
+ *	pmempool create obj --layout=freq -s 1G freqcount
+ */
+#ifndef LIBFREQ_PMEM_H
+#define LIBFREQ_PMEM_H 1
+
+#include "libfreq.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* freq_pmem_open() flags */
+#define FREQ_PMEM_CREATE	0x1	/* make a table if the pool has none */
+#define FREQ_PMEM_SHARED_HEAP	0x2	/* default classes, shared arenas */
+#define FREQ_PMEM_RDONLY	0x4	/* never write to the pool */
+
+/*
+ * create a pool of size bytes for freq_pmem_open() at path, which must not
+ * exist, as pmempool create obj --layout=freq does
+ */
+void freq_pmem_create(const char *path, uint64_t size);
+
+/* open the word table in a pmem pool, safe for concurrent count() calls */
+struct freq_table *freq_pmem_open(const char *path, int flags);
+
+/*
+ * add n to the count for a word in a table from freq_pmem_open(), for a
+ * caller that already has the word's freq_hash() in h; it goes straight
+ * to the pmem table instead of through freq_add()
+ */
+void freq_pmem_add(struct freq_table *t, const char *word, unsigned h,
+		uint64_t n);
+
+/*
+ * the allocations in a pool, see freq_pmem_usage().  libpmemobj doesn't
+ * say which allocation class an object came from, so sizes[] groups them
+ * by usable size, which only approximates the classes: a class hands out
+ * multiples of its unit size, and two classes can share a size
+ */
+#define FREQ_PMEM_NSIZES	32
+
+struct freq_pmem_usage {
+	uint64_t heap_allocated;	/* stats.heap.curr_allocated */
+	uint64_t run_allocated;		/* bytes allocated from runs */
+	uint64_t run_active;		/* bytes in runs, allocated or not */
+	uint64_t nallocs;		/* objects allocated in the pool */
+	uint64_t bytes;			/* their usable sizes and headers */
+	size_t nsizes;			/* entries used in sizes[] */
+	struct {
+		uint64_t size;		/* usable size */
+		uint64_t count;		/* allocations of that size */
+	} sizes[FREQ_PMEM_NSIZES];	/* smallest size first */
+	uint64_t other_count;		/* allocations of sizes not in it */
+};
+
+/*
+ * add the counts in a run file, as freq_run_write() makes, to a table
+ * from freq_pmem_open(); nothing else may use the table meanwhile
+ */
+void freq_pmem_import(struct freq_table *t, const char *path);
+
+/*
+ * add the counts of table src to table dst, both from freq_pmem_open(),
+ * in nthreads threads each merging a range of buckets.  Progress is kept
+ * in dst's pool along with the counts, so a merge that is interrupted
+ * is resumed by merging from the same pool again, and nothing is counted
+ * twice; until then dst refuses merges from other pools.  Nothing else
+ * may use dst meanwhile.
+ */
+void freq_pmem_merge(struct freq_table *dst, struct freq_table *src,
+		unsigned nthreads);
+
+/*
+ * what a table from freq_pmem_open() takes in its pool, walking all of
+ * it; too slow to be the freq_stats() the limits use
+ */
+void freq_pmem_stats(struct freq_table *t, struct freq_stats *st);
+
+/*
+ * count every allocation in the pool of a table from freq_pmem_open();
+ * the heap statistics are only kept for a table opened for writing
+ */
+void freq_pmem_usage(struct freq_table *t, struct freq_pmem_usage *u);
+
+/*
+ * rewrite the entries of a table from freq_pmem_open() bucket by bucket
+ * into adjacent allocations; nothing else may use the table meanwhile
+ */
+void freq_pmem_compact(struct freq_table *t);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
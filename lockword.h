@@ -0,0 +1,134 @@
+/*
+ * lockword.h -- one-word locks for the concurrent tables
+ *
+ * a lock word is a uint32_t that is 0 when unlocked, 1 when locked and
+ * 2 when locked with threads possibly asleep on it.  Locking spins for
+ * a while before sleeping in the kernel, unlocking only makes a system
+ * call when someone may be asleep.
+ *
+ * a sequence word lets readers look at what it protects without writing
+ * to shared memory: writers, already serialized by a lock word, make it
+ * odd while they change things, and readers retry if it moved under them.
+ *
+ * an event word lets a thread sleep until another has work for it.  The
+ * sleeper arms it, looks for work once more and, finding none, waits;
+ * whoever makes work publishes it and then signals, which only makes a
+ * system call when someone is armed.  The low bit says someone is.
+ */
+#ifndef LOCKWORD_H
+#define LOCKWORD_H 1
+
+#include <linux/futex.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* times to look at a held lock before going to sleep on it */
+#define FREQ_SPINS 128
+
+static inline void freq_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+}
+
+static inline void freq_lock(uint32_t *l)
+{
+	uint32_t c = 0;
+
+	if (__atomic_compare_exchange_n(l, &c, 1, 0, __ATOMIC_ACQUIRE,
+			__ATOMIC_RELAXED))
+		return;
+
+	/* spin while the holder is likely to let go soon */
+	for (int i = 0; i < FREQ_SPINS && c != 2; i++) {
+		freq_cpu_relax();
+		if ((c = __atomic_load_n(l, __ATOMIC_RELAXED)) == 0 &&
+		    __atomic_compare_exchange_n(l, &c, 1, 0,
+				__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return;
+	}
+
+	/* mark it contended, then sleep until it is handed back free */
+	while (__atomic_exchange_n(l, 2, __ATOMIC_ACQUIRE) != 0)
+		syscall(SYS_futex, l, FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
+}
+
+/* take a lock word only if it is free, true if it was */
+static inline int freq_trylock(uint32_t *l)
+{
+	uint32_t c = 0;
+
+	return __atomic_compare_exchange_n(l, &c, 1, 0, __ATOMIC_ACQUIRE,
+			__ATOMIC_RELAXED);
+}
+
+static inline void freq_unlock(uint32_t *l)
+{
+	if (__atomic_exchange_n(l, 0, __ATOMIC_RELEASE) == 2)
+		syscall(SYS_futex, l, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+/* start reading under a sequence word, returns what to check against */
+static inline uint32_t freq_seq_begin(const uint32_t *seq)
+{
+	uint32_t s;
+
+	while ((s = __atomic_load_n(seq, __ATOMIC_ACQUIRE)) & 1)
+		freq_cpu_relax();
+
+	return s;
+}
+
+/* true if what was read since freq_seq_begin() returned s may be torn */
+static inline int freq_seq_retry(const uint32_t *seq, uint32_t s)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(seq, __ATOMIC_RELAXED) != s;
+}
+
+/* bracket a change readers mustn't see half done, under a lock word */
+static inline void freq_seq_write_begin(uint32_t *seq)
+{
+	__atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void freq_seq_write_end(uint32_t *seq)
+{
+	__atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+/* about to sleep on an event word, returns what to wait with */
+static inline uint32_t freq_event_arm(uint32_t *ev)
+{
+	uint32_t v = __atomic_or_fetch(ev, 1, __ATOMIC_SEQ_CST);
+
+	/* the look for work that follows mustn't move before this */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return v;
+}
+
+/* sleep unless the word was signalled since freq_event_arm() returned v */
+static inline void freq_event_wait(uint32_t *ev, uint32_t v)
+{
+	syscall(SYS_futex, ev, FUTEX_WAIT_PRIVATE, v, NULL, NULL, 0);
+}
+
+/* wake whoever is armed on an event word, after publishing the work */
+static inline void freq_event_signal(uint32_t *ev)
+{
+	uint32_t v;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	v = __atomic_load_n(ev, __ATOMIC_RELAXED);
+	while ((v & 1) && !__atomic_compare_exchange_n(ev, &v, v + 1, 0,
+			__ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		;
+	if (v & 1)
+		syscall(SYS_futex, ev, FUTEX_WAKE_PRIVATE, INT32_MAX, NULL,
+				NULL, 0);
+}
+
+#endif
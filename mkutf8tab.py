@@ -0,0 +1,68 @@
+#!/usr/bin/env python3
+#
+# mkutf8tab.py -- generate utf8tab.c, the Unicode class tables for libfreq
+#
+# usage: ./mkutf8tab.py > utf8tab.c
+#
+# every code point gets a 2-bit class code, 0 for a delimiter, 1 for a
+# letter (general category L*, plus the marks M* that combine with it),
+# 2 for a decimal digit (Nd), 3 for an apostrophe (U+2019).  The codes
+# are stored four to a byte in blocks of 256 code points, and identical
+# blocks are stored once, freq_uclass() in libfreq.h does the lookup.
+#
+import sys
+import unicodedata
+
+BLOCK = 256
+NCODEPOINTS = 0x110000
+
+
+def uclass(cp):
+    if cp == 0x2019:
+        return 3
+    cat = unicodedata.category(chr(cp))
+    if cat[0] in 'LM':
+        return 1
+    if cat == 'Nd':
+        return 2
+    return 0
+
+
+def main():
+    blocks = {}
+    index = []
+    for b in range(NCODEPOINTS // BLOCK):
+        codes = tuple(uclass(cp) for cp in range(b * BLOCK, (b + 1) * BLOCK))
+        index.append(blocks.setdefault(codes, len(blocks)))
+    assert len(blocks) < 256
+
+    out = sys.stdout
+    out.write('/*\n')
+    out.write(' * utf8tab.c -- Unicode %s class tables, generated by '
+              'mkutf8tab.py\n' % unicodedata.unidata_version)
+    out.write(' *\n * do not edit, rerun mkutf8tab.py instead\n */\n')
+    out.write('#include "libfreq.h"\n\n')
+
+    out.write('/* block of each 256 code points */\n')
+    out.write('const unsigned char freq_ustage1[%d] = {\n' % len(index))
+    for i in range(0, len(index), 12):
+        out.write('\t' + ', '.join('%d' % v for v in index[i:i + 12]) +
+                  ',\n')
+    out.write('};\n\n')
+
+    out.write('/* 2-bit class codes, four code points per byte */\n')
+    out.write('const unsigned char freq_ustage2[%d][%d] = {\n' %
+              (len(blocks), BLOCK // 4))
+    for codes in sorted(blocks, key=blocks.get):
+        packed = [codes[i] | codes[i + 1] << 2 | codes[i + 2] << 4 |
+                  codes[i + 3] << 6 for i in range(0, BLOCK, 4)]
+        out.write('\t{\n')
+        for i in range(0, len(packed), 8):
+            out.write('\t\t' + ', '.join('0x%02x' % v
+                                        for v in packed[i:i + 8]) + ',\n')
+        out.write('\t},\n')
+    out.write('};\n')
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,688 @@
+/*
+ * spill.c -- run files, and spilling tables to them
+ *
+ * a run file holds word counts sorted by word, split into parts by
+ * freq_hash() so the parts of many runs can be merged in parallel.
+ * Everything is little-endian, so runs move between machines:
+ *
+ *	8 bytes		"FREQRUN\n"
+ *	uint32_t	version, RUN_VERSION
+ *	uint32_t	nparts
+ *	uint64_t	offset[nparts + 1], where parts start, then the end
+ *	records		uint64_t count, uint32_t len, len bytes of word
+ *
+ * within a part records are in strcmp() order of their words, and no
+ * word appears twice.  A table that gets over its limits with spilling
+ * on writes itself out as a run and starts again empty; printing it
+ * writes the rest and merges all of its runs.  Every SPILL_MAXRUNS runs
+ * are merged into one as they pile up, so a merge never has more than
+ * that many to read.
+ */
+#define _GNU_SOURCE
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libfreq.h"
+
+#define RUN_MAGIC "FREQRUN\n"
+#define RUN_VERSION 1
+
+/* stdio buffer for a run being written, and for each part being read */
+#define WRITEBUFSIZE (1 << 20)
+#define READBUFSIZE 65536
+
+/* runs a table spills before they are merged into one */
+#define SPILL_MAXRUNS 16
+
+/* what a table spilled, and where */
+struct freq_spill {
+	char *dir;
+	unsigned nparts;
+	int nruns;
+	char **paths;
+};
+
+static void put_u32(FILE *fp, uint32_t v)
+{
+	unsigned char b[4];
+
+	for (int i = 0; i < 4; i++)
+		b[i] = v >> (8 * i);
+	fwrite(b, 1, sizeof(b), fp);
+}
+
+static void put_u64(FILE *fp, uint64_t v)
+{
+	unsigned char b[8];
+
+	for (int i = 0; i < 8; i++)
+		b[i] = v >> (8 * i);
+	fwrite(b, 1, sizeof(b), fp);
+}
+
+/* read a little-endian value of n bytes, -1 at end of file */
+static int get_le(FILE *fp, uint64_t *vp, int n)
+{
+	unsigned char b[8];
+
+	if (fread(b, 1, n, fp) != (size_t)n)
+		return -1;
+
+	*vp = 0;
+	for (int i = n - 1; i >= 0; i--)
+		*vp = *vp << 8 | b[i];
+	return 0;
+}
+
+static void put_record(FILE *fp, const char *word, uint64_t count)
+{
+	uint32_t len = strlen(word);
+
+	put_u64(fp, count);
+	put_u32(fp, len);
+	fwrite(word, 1, len, fp);
+}
+
+/* an entry on its way to a run */
+struct rentry {
+	const char *word;
+	uint64_t count;
+	unsigned part;
+};
+
+/* entries gathered by freq_walk() */
+struct gather {
+	struct rentry *e;
+	size_t n, size;
+	unsigned nparts;
+};
+
+static void gather_entry(const char *word, uint64_t count, void *arg)
+{
+	struct gather *g = arg;
+
+	if (g->n == g->size) {
+		g->size = g->size ? 2 * g->size : 4096;
+		if ((g->e = realloc(g->e, g->size * sizeof(*g->e))) == NULL)
+			err(1, "realloc");
+	}
+
+	g->e[g->n].word = word;
+	g->e[g->n].count = count;
+	g->e[g->n++].part = freq_hash(word) % g->nparts;
+}
+
+static int rentry_cmp(const void *a, const void *b)
+{
+	const struct rentry *x = a, *y = b;
+
+	if (x->part != y->part)
+		return x->part < y->part ? -1 : 1;
+	return strcmp(x->word, y->word);
+}
+
+/* a run written by walking a part at a time, see write_parts() */
+struct writer {
+	struct freq_table *t;
+	const char *path;
+	unsigned next;			/* next part to take */
+	unsigned nparts;
+	int sizing;			/* only adding up the parts' sizes */
+	uint64_t off[FREQ_MAXPARTS + 1];	/* sizes, then part starts */
+	pthread_mutex_t lock;		/* protects next */
+};
+
+static void size_entry(const char *word, uint64_t count, void *arg)
+{
+	*(uint64_t *)arg += 12 + strlen(word);
+}
+
+/* size part p, or write it where it goes in the run */
+static void write_part(struct writer *w, unsigned p)
+{
+	struct gather g = { .nparts = w->nparts };
+	FILE *fp;
+
+	if (w->sizing) {
+		w->off[p + 1] = 0;
+		w->t->ops->walk_part(w->t, p, w->nparts, size_entry,
+				&w->off[p + 1]);
+		return;
+	}
+
+	w->t->ops->walk_part(w->t, p, w->nparts, gather_entry, &g);
+	qsort(g.e, g.n, sizeof(*g.e), rentry_cmp);
+
+	/* each thread has a stream of its own on the file */
+	if ((fp = fopen(w->path, "r+")) == NULL)
+		err(1, "%s", w->path);
+	setvbuf(fp, NULL, _IOFBF, WRITEBUFSIZE);
+
+	if (fseek(fp, w->off[p], SEEK_SET) < 0)
+		err(1, "%s", w->path);
+	for (size_t i = 0; i < g.n; i++)
+		put_record(fp, g.e[i].word, g.e[i].count);
+
+	if (ftell(fp) != (long)w->off[p + 1])
+		errx(1, "%s: part %u changed while being written", w->path,
+				p);
+	if (ferror(fp) || fclose(fp) == EOF)
+		err(1, "%s", w->path);
+
+	free(g.e);
+}
+
+/* thread start routine, size or write parts until there are none left */
+static void *write_parts(void *arg)
+{
+	struct writer *w = arg;
+
+	for (;;) {
+		pthread_mutex_lock(&w->lock);
+		unsigned p = w->next++;
+		pthread_mutex_unlock(&w->lock);
+
+		if (p >= w->nparts)
+			return NULL;
+		write_part(w, p);
+	}
+}
+
+/* run write_parts() in a thread per CPU, at most one per part */
+static void run_writers(struct writer *w)
+{
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned nthreads = ncpus < 1 ? 1 :
+			ncpus < w->nparts ? ncpus : w->nparts;
+	pthread_t tids[nthreads];
+
+	w->next = 0;
+
+	for (unsigned i = 1; i < nthreads; i++)
+		if ((errno = pthread_create(&tids[i], NULL, write_parts,
+				w)) != 0)
+			err(1, "pthread_create %u of %u", i, nthreads);
+
+	write_parts(w);
+
+	for (unsigned i = 1; i < nthreads; i++)
+		pthread_join(tids[i], NULL);
+}
+
+/*
+ * write a run in two passes over the parts, the first finds how big each
+ * is, so the second can write every part straight to its place; only a
+ * part's entries at a time are held in memory per thread
+ */
+static void write_parallel(struct freq_table *t, const char *path,
+		unsigned nparts)
+{
+	struct writer w = {
+		.t = t,
+		.path = path,
+		.nparts = nparts,
+		.sizing = 1,
+	};
+	FILE *fp;
+
+	pthread_mutex_init(&w.lock, NULL);
+
+	run_writers(&w);
+
+	w.off[0] = 16 + 8 * (nparts + 1);
+	for (unsigned p = 0; p < nparts; p++)
+		w.off[p + 1] += w.off[p];
+
+	if ((fp = fopen(path, "w")) == NULL)
+		err(1, "%s", path);
+
+	fwrite(RUN_MAGIC, 1, 8, fp);
+	put_u32(fp, RUN_VERSION);
+	put_u32(fp, nparts);
+	for (unsigned p = 0; p <= nparts; p++)
+		put_u64(fp, w.off[p]);
+
+	if (fflush(fp) == EOF || ftruncate(fileno(fp), w.off[nparts]) < 0 ||
+	    ferror(fp) || fclose(fp) == EOF)
+		err(1, "%s", path);
+
+	w.sizing = 0;
+	run_writers(&w);
+
+	pthread_mutex_destroy(&w.lock);
+}
+
+/* start a run written a part after another, see run_finish() */
+static FILE *run_create(const char *path, unsigned nparts)
+{
+	FILE *fp;
+
+	if ((fp = fopen(path, "w")) == NULL)
+		err(1, "%s", path);
+	setvbuf(fp, NULL, _IOFBF, WRITEBUFSIZE);
+
+	/* the offsets are only known once the parts are written */
+	fwrite(RUN_MAGIC, 1, 8, fp);
+	put_u32(fp, RUN_VERSION);
+	put_u32(fp, nparts);
+	for (unsigned p = 0; p <= nparts; p++)
+		put_u64(fp, 0);
+
+	return fp;
+}
+
+/* fill in the offsets of a run from run_create() and close it */
+static void run_finish(FILE *fp, const char *path, unsigned nparts,
+		const uint64_t *off)
+{
+	if (fseek(fp, 16, SEEK_SET) < 0)
+		err(1, "%s", path);
+	for (unsigned p = 0; p <= nparts; p++)
+		put_u64(fp, off[p]);
+
+	if (ferror(fp) || fclose(fp) == EOF)
+		err(1, "%s", path);
+}
+
+void freq_run_write(struct freq_table *t, const char *path, unsigned nparts)
+{
+	struct gather g = { .nparts = nparts };
+	uint64_t off[FREQ_MAXPARTS + 1];
+	FILE *fp;
+	size_t i = 0;
+
+	if (nparts < 1 || nparts > FREQ_MAXPARTS)
+		errx(1, "%s: %u parts, not 1 to %d", path, nparts,
+				FREQ_MAXPARTS);
+
+	if (t->ops->walk_part != NULL) {
+		write_parallel(t, path, nparts);
+		return;
+	}
+
+	freq_walk(t, gather_entry, &g);
+	qsort(g.e, g.n, sizeof(*g.e), rentry_cmp);
+
+	fp = run_create(path, nparts);
+	off[0] = ftell(fp);
+
+	for (unsigned p = 0; p < nparts; p++) {
+		for (; i < g.n && g.e[i].part == p; i++)
+			put_record(fp, g.e[i].word, g.e[i].count);
+		off[p + 1] = ftell(fp);
+	}
+
+	run_finish(fp, path, nparts, off);
+	free(g.e);
+}
+
+/* reads one part of one run */
+struct cursor {
+	FILE *fp;
+	const char *path;
+	uint64_t left;			/* bytes of the part unread */
+	uint64_t count;
+	char *word;			/* NUL-terminated, NULL once done */
+	size_t size;			/* bytes at word */
+};
+
+/* move a cursor on to its next record, word is NULL if there is none */
+static void cursor_next(struct cursor *c)
+{
+	uint64_t count, len;
+
+	if (c->left == 0) {
+		free(c->word);
+		c->word = NULL;
+		return;
+	}
+
+	if (c->left < 12 || get_le(c->fp, &count, 8) < 0 ||
+	    get_le(c->fp, &len, 4) < 0 || c->left - 12 < len)
+		errx(1, "%s: truncated run", c->path);
+
+	if (len + 1 > c->size) {
+		c->size = len + 1;
+		if ((c->word = realloc(c->word, c->size)) == NULL)
+			err(1, "realloc");
+	}
+
+	if (fread(c->word, 1, len, c->fp) != len)
+		errx(1, "%s: truncated run", c->path);
+	c->word[len] = '\0';
+	c->count = count;
+	c->left -= 12 + len;
+}
+
+/* open a run, check it and return its number of parts */
+static FILE *run_open(const char *path, unsigned *npartsp)
+{
+	char magic[8];
+	uint64_t version, nparts;
+	FILE *fp;
+
+	if ((fp = fopen(path, "r")) == NULL)
+		err(1, "%s", path);
+	setvbuf(fp, NULL, _IOFBF, READBUFSIZE);
+
+	if (fread(magic, 1, 8, fp) != 8 || memcmp(magic, RUN_MAGIC, 8) != 0 ||
+	    get_le(fp, &version, 4) < 0 || get_le(fp, &nparts, 4) < 0)
+		errx(1, "%s: not a run file", path);
+	if (version != RUN_VERSION)
+		errx(1, "%s: run version %u, expected %d", path,
+				(unsigned)version, RUN_VERSION);
+	if (nparts < 1 || nparts > FREQ_MAXPARTS)
+		errx(1, "%s: bad number of parts %u", path, (unsigned)nparts);
+
+	*npartsp = nparts;
+	return fp;
+}
+
+/* open a cursor on part p of a run */
+static void cursor_open(struct cursor *c, const char *path, unsigned p)
+{
+	uint64_t start, end;
+	unsigned nparts;
+
+	c->fp = run_open(path, &nparts);
+	c->path = path;
+	c->word = NULL;
+	c->size = 0;
+
+	if (p >= nparts || fseek(c->fp, 16 + 8 * p, SEEK_SET) < 0 ||
+	    get_le(c->fp, &start, 8) < 0 || get_le(c->fp, &end, 8) < 0 ||
+	    end < start || fseek(c->fp, start, SEEK_SET) < 0)
+		errx(1, "%s: bad part %u", path, p);
+
+	c->left = end - start;
+	cursor_next(c);
+}
+
+/* the cursors of a merge, kept as a binary heap by word */
+static void sift_down(struct cursor **h, size_t n, size_t i)
+{
+	for (;;) {
+		size_t min = i, l = 2 * i + 1, r = l + 1;
+
+		if (l < n && strcmp(h[l]->word, h[min]->word) < 0)
+			min = l;
+		if (r < n && strcmp(h[r]->word, h[min]->word) < 0)
+			min = r;
+		if (min == i)
+			return;
+
+		struct cursor *tmp = h[i];
+
+		h[i] = h[min];
+		h[min] = tmp;
+		i = min;
+	}
+}
+
+/* a merge of one part of every run, for a thread of freq_run_merge() */
+struct merge {
+	const char *const *paths;
+	int nruns;
+	unsigned next;			/* next part to take */
+	unsigned nparts;
+	freq_walk_fn fn;
+	void *arg;
+	pthread_mutex_t lock;		/* protects next and calls of fn */
+};
+
+/* merge part p of every run, calling fn once for each word */
+static void merge_part(struct merge *m, unsigned p)
+{
+	struct cursor *c = calloc(m->nruns, sizeof(*c));
+	struct cursor **h = calloc(m->nruns, sizeof(*h));
+	size_t n = 0;
+
+	if (c == NULL || h == NULL)
+		err(1, "calloc");
+
+	for (int i = 0; i < m->nruns; i++) {
+		cursor_open(&c[i], m->paths[i], p);
+		if (c[i].word != NULL)
+			h[n++] = &c[i];
+		else
+			fclose(c[i].fp);
+	}
+
+	for (size_t i = n / 2; i-- > 0; )
+		sift_down(h, n, i);
+
+	while (n > 0) {
+		/* the smallest word, summed over every run that has it */
+		char *word = strdup(h[0]->word);
+		uint64_t count = 0;
+
+		if (word == NULL)
+			err(1, "strdup");
+
+		while (n > 0 && strcmp(h[0]->word, word) == 0) {
+			count = freq_sat_add(count, h[0]->count);
+			cursor_next(h[0]);
+			if (h[0]->word == NULL) {
+				fclose(h[0]->fp);
+				h[0] = h[--n];
+			}
+			sift_down(h, n, 0);
+		}
+
+		pthread_mutex_lock(&m->lock);
+		m->fn(word, count, m->arg);
+		pthread_mutex_unlock(&m->lock);
+		free(word);
+	}
+
+	free(h);
+	free(c);
+}
+
+/* thread start routine, merge parts until there are none left */
+static void *merge_parts(void *arg)
+{
+	struct merge *m = arg;
+
+	for (;;) {
+		pthread_mutex_lock(&m->lock);
+		unsigned p = m->next++;
+		pthread_mutex_unlock(&m->lock);
+
+		if (p >= m->nparts)
+			return NULL;
+		merge_part(m, p);
+	}
+}
+
+void freq_run_merge(const char *const *paths, int nruns, unsigned nthreads,
+		freq_walk_fn fn, void *arg)
+{
+	struct merge m = {
+		.paths = paths,
+		.nruns = nruns,
+		.fn = fn,
+		.arg = arg,
+	};
+	unsigned nparts;
+
+	if (nruns == 0)
+		return;
+	if (nruns > FREQ_MAXOPEN)
+		errx(1, "%d runs to merge, at most %d at once", nruns,
+				FREQ_MAXOPEN);
+
+	/* runs merge part by part, so they must agree on the parts */
+	for (int i = 0; i < nruns; i++) {
+		fclose(run_open(paths[i], &nparts));
+		if (i > 0 && nparts != m.nparts)
+			errx(1, "%s: %u parts, %s has %u", paths[i], nparts,
+					paths[0], m.nparts);
+		m.nparts = nparts;
+	}
+
+	/* each thread has a file of every run open */
+	if (nthreads > m.nparts)
+		nthreads = m.nparts;
+	if (nthreads > (unsigned)(FREQ_MAXOPEN / nruns))
+		nthreads = FREQ_MAXOPEN / nruns;
+	if (nthreads < 1)
+		nthreads = 1;
+
+	pthread_t tids[nthreads];
+
+	pthread_mutex_init(&m.lock, NULL);
+
+	for (unsigned i = 1; i < nthreads; i++)
+		if ((errno = pthread_create(&tids[i], NULL, merge_parts,
+				&m)) != 0)
+			err(1, "pthread_create %u of %u", i, nthreads);
+
+	merge_parts(&m);
+
+	for (unsigned i = 1; i < nthreads; i++)
+		pthread_join(tids[i], NULL);
+
+	pthread_mutex_destroy(&m.lock);
+}
+
+int freq_set_spill(struct freq_table *t, const char *dir, unsigned nparts)
+{
+	struct freq_spill *sp;
+
+	/* by default a part for each CPU to merge */
+	if (nparts == 0 && (nparts = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		nparts = 1;
+	if (nparts > FREQ_MAXPARTS)
+		nparts = FREQ_MAXPARTS;
+
+	if (t->ops->prune == NULL || t->ops->size == NULL)
+		return -1;
+
+	if ((sp = calloc(1, sizeof(*sp))) == NULL)
+		err(1, "calloc");
+	if ((sp->dir = strdup(dir)) == NULL)
+		err(1, "strdup");
+	sp->nparts = nparts;
+
+	t->spill = sp;
+	return 0;
+}
+
+/* a new run file's path in a table's spill directory */
+static char *run_path(struct freq_spill *sp)
+{
+	static unsigned serial;
+	char *path;
+
+	if (asprintf(&path, "%s/freq-%d-%u.run", sp->dir, (int)getpid(),
+			__atomic_fetch_add(&serial, 1, __ATOMIC_RELAXED)) < 0)
+		err(1, "asprintf");
+
+	return path;
+}
+
+/* freq_walk_fn for compact_runs(), write a merged word to the run */
+static void put_entry(const char *word, uint64_t count, void *arg)
+{
+	put_record(arg, word, count);
+}
+
+/*
+ * merge the runs a table has spilled into one new run and remove them,
+ * a part at a time in this thread, so only a file of each is open
+ */
+static void compact_runs(struct freq_spill *sp)
+{
+	char *path = run_path(sp);
+	FILE *fp = run_create(path, sp->nparts);
+	uint64_t off[FREQ_MAXPARTS + 1];
+	struct merge m = {
+		.paths = (const char *const *)sp->paths,
+		.nruns = sp->nruns,
+		.nparts = sp->nparts,
+		.fn = put_entry,
+		.arg = fp,
+	};
+
+	pthread_mutex_init(&m.lock, NULL);
+
+	off[0] = ftell(fp);
+	for (unsigned p = 0; p < sp->nparts; p++) {
+		merge_part(&m, p);
+		off[p + 1] = ftell(fp);
+	}
+
+	run_finish(fp, path, sp->nparts, off);
+	pthread_mutex_destroy(&m.lock);
+
+	for (int i = 0; i < sp->nruns; i++) {
+		if (unlink(sp->paths[i]) < 0)
+			warn("%s", sp->paths[i]);
+		free(sp->paths[i]);
+	}
+
+	sp->paths[0] = path;
+	sp->nruns = 1;
+}
+
+void freq_spill(struct freq_table *t)
+{
+	struct freq_spill *sp = t->spill;
+	char *path = run_path(sp);
+
+	freq_run_write(t, path, sp->nparts);
+
+	/*
+	 * start again empty; a count that saturated stays, and is in
+	 * the next run as well, which is fine as it saturates the sum too
+	 */
+	t->ops->prune(t, UINT64_MAX);
+
+	if ((sp->paths = realloc(sp->paths, (sp->nruns + 1) *
+			sizeof(*sp->paths))) == NULL)
+		err(1, "realloc");
+	sp->paths[sp->nruns++] = path;
+
+	if (sp->nruns == SPILL_MAXRUNS)
+		compact_runs(sp);
+}
+
+void freq_spill_walk(struct freq_table *t, freq_walk_fn fn, void *arg)
+{
+	struct freq_spill *sp = t->spill;
+
+	if (sp == NULL || sp->nruns == 0) {
+		freq_walk(t, fn, arg);
+		return;
+	}
+
+	/* everything counted since the last run goes in one more */
+	if (t->ops->size(t) != 0)
+		freq_spill(t);
+
+	freq_run_merge((const char *const *)sp->paths, sp->nruns, sp->nparts,
+			fn, arg);
+}
+
+void freq_spill_close(struct freq_table *t)
+{
+	struct freq_spill *sp = t->spill;
+
+	for (int i = 0; i < sp->nruns; i++) {
+		if (unlink(sp->paths[i]) < 0)
+			warn("%s", sp->paths[i]);
+		free(sp->paths[i]);
+	}
+
+	free(sp->paths);
+	free(sp->dir);
+	free(sp);
+	t->spill = NULL;
+}
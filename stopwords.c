@@ -0,0 +1,250 @@
+/*
+ * stopwords.c -- stopword sets looked up through a minimal perfect hash
+ *
+ * a set of n words has exactly n slots.  Looking a word up costs one
+ * hash of the word, one displacement load and one compare, whatever the
+ * size of the set, so the tokenizer can drop stopwords before they reach
+ * a table and its locks.
+ */
+#include <err.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libfreq.h"
+#include "stopwords.h"
+
+/* give up on a bucket after trying this many displacements */
+#define MAXDISP (1U << 24)
+
+struct freq_stopwords {
+	size_t n;		/* number of words, and of slots */
+	size_t nbuckets;
+	uint32_t *disp;		/* displacement of each bucket */
+	char **slots;		/* word in each slot */
+	size_t *lens;		/* length of the word in each slot */
+};
+
+/* 64-bit FNV-1a of the len bytes at s */
+static inline uint64_t sw_hash(const char *s, size_t len)
+{
+	uint64_t h = FREQ_SW_FNV_BASIS;
+
+	for (size_t i = 0; i < len; i++) {
+		h ^= (unsigned char)s[i];
+		h *= FREQ_SW_FNV_PRIME;
+	}
+
+	return h;
+}
+
+/* slot of a word with hash h in a bucket with displacement d */
+static inline size_t sw_slot(uint64_t h, uint32_t d, size_t n)
+{
+	uint64_t x = h ^ (d * FREQ_SW_GOLDEN);
+
+	/* splitmix64 finalizer */
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+
+	return x % n;
+}
+
+static int cmpstr(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* buckets in the order they get placed, largest first */
+struct border {
+	size_t size;
+	size_t bucket;
+};
+
+static int cmpborder(const void *a, const void *b)
+{
+	const struct border *x = a, *y = b;
+
+	if (x->size != y->size)
+		return x->size < y->size ? 1 : -1;
+	return x->bucket < y->bucket ? -1 : x->bucket > y->bucket;
+}
+
+/* build a stopword set from n words, duplicates are allowed */
+struct freq_stopwords *freq_stopwords_create(const char *const *words,
+		size_t n)
+{
+	struct freq_stopwords *sw;
+	char **w;
+
+	if ((sw = calloc(1, sizeof(*sw))) == NULL)
+		err(1, "calloc");
+
+	/* sort a copy of the list so duplicates can be dropped */
+	if ((w = malloc((n + 1) * sizeof(*w))) == NULL)
+		err(1, "malloc");
+	memcpy(w, words, n * sizeof(*w));
+	qsort(w, n, sizeof(*w), cmpstr);
+
+	size_t nw = 0;
+	for (size_t i = 0; i < n; i++)
+		if (nw == 0 || strcmp(w[nw - 1], w[i]) != 0)
+			w[nw++] = w[i];
+
+	sw->n = nw;
+	sw->nbuckets = FREQ_SW_NBUCKETS(nw);
+
+	uint64_t *h = malloc((nw + 1) * sizeof(*h));
+	size_t *start = calloc(sw->nbuckets + 1, sizeof(*start));
+	size_t *member = malloc((nw + 1) * sizeof(*member));
+	struct border *order = malloc(sw->nbuckets * sizeof(*order));
+	char *taken = calloc(nw + 1, 1);
+	size_t *slot = malloc((nw + 1) * sizeof(*slot));
+
+	sw->disp = calloc(sw->nbuckets, sizeof(*sw->disp));
+	sw->slots = calloc(nw + 1, sizeof(*sw->slots));
+	sw->lens = calloc(nw + 1, sizeof(*sw->lens));
+
+	if (h == NULL || start == NULL || member == NULL || order == NULL ||
+	    taken == NULL || slot == NULL || sw->disp == NULL ||
+	    sw->slots == NULL || sw->lens == NULL)
+		err(1, "malloc");
+
+	/* group the words by bucket */
+	for (size_t i = 0; i < nw; i++) {
+		h[i] = sw_hash(w[i], strlen(w[i]));
+		start[(h[i] >> 32) % sw->nbuckets + 1]++;
+	}
+	for (size_t b = 0; b < sw->nbuckets; b++) {
+		order[b].size = start[b + 1];
+		order[b].bucket = b;
+		start[b + 1] += start[b];
+	}
+	for (size_t i = 0; i < nw; i++)
+		member[start[(h[i] >> 32) % sw->nbuckets]++] = i;
+	for (size_t b = sw->nbuckets; b > 0; b--)
+		start[b] = start[b - 1];
+	start[0] = 0;
+
+	/* place the biggest buckets first, while most slots are free */
+	qsort(order, sw->nbuckets, sizeof(*order), cmpborder);
+
+	for (size_t o = 0; o < sw->nbuckets && order[o].size != 0; o++) {
+		size_t b = order[o].bucket;
+		size_t *m = &member[start[b]];
+		size_t size = order[o].size;
+		uint32_t d;
+
+		for (d = 0; d < MAXDISP; d++) {
+			size_t k;
+
+			for (k = 0; k < size; k++) {
+				slot[k] = sw_slot(h[m[k]], d, nw);
+				if (taken[slot[k]])
+					break;
+				taken[slot[k]] = 1;
+			}
+
+			if (k == size)
+				break;
+
+			/* collision, release what this try took */
+			while (k-- > 0)
+				taken[slot[k]] = 0;
+		}
+
+		if (d == MAXDISP)
+			errx(1, "can't build stopword hash for %zu words", nw);
+
+		sw->disp[b] = d;
+		for (size_t k = 0; k < size; k++) {
+			if ((sw->slots[slot[k]] = strdup(w[m[k]])) == NULL)
+				err(1, "strdup");
+			sw->lens[slot[k]] = strlen(w[m[k]]);
+		}
+	}
+
+	free(slot);
+	free(taken);
+	free(order);
+	free(member);
+	free(start);
+	free(h);
+	free(w);
+	return sw;
+}
+
+/* true if the len bytes at word are in the set */
+int freq_is_stopword(const struct freq_stopwords *sw, const char *word,
+		size_t len)
+{
+	if (sw->n == 0)
+		return 0;
+
+	uint64_t h = sw_hash(word, len);
+	size_t s = sw_slot(h, sw->disp[(h >> 32) % sw->nbuckets], sw->n);
+
+	return sw->lens[s] == len && memcmp(sw->slots[s], word, len) == 0;
+}
+
+void freq_stopwords_free(struct freq_stopwords *sw)
+{
+	for (size_t i = 0; i < sw->n; i++)
+		free(sw->slots[i]);
+	free(sw->lens);
+	free(sw->slots);
+	free(sw->disp);
+	free(sw);
+}
+
+/* growable list of words collected for freq_tokopts_setup() */
+struct wordlist {
+	char **words;
+	size_t n;
+	size_t size;
+};
+
+static void wordlist_add(const char *word, void *arg)
+{
+	struct wordlist *wl = arg;
+
+	if (wl->n == wl->size) {
+		wl->size = wl->size ? wl->size * 2 : 256;
+		if ((wl->words = realloc(wl->words,
+				wl->size * sizeof(*wl->words))) == NULL)
+			err(1, "realloc");
+	}
+
+	if ((wl->words[wl->n++] = strdup(word)) == NULL)
+		err(1, "strdup");
+}
+
+/* finish setting up options parsed by freq_tokopt(), loads stopwords */
+void freq_tokopts_setup(struct freq_tokopts *opts)
+{
+	static const char *const builtin[] = { FREQ_BUILTIN_STOPWORDS };
+	struct wordlist wl = { NULL, 0, 0 };
+
+	if (opts->stopfile == NULL && !opts->stopbuiltin)
+		return;
+
+	if (opts->stopbuiltin)
+		for (size_t i = 0; i < sizeof(builtin) / sizeof(*builtin); i++)
+			wordlist_add(builtin[i], &wl);
+
+	if (opts->stopfile != NULL) {
+		/* stopwords are tokenized just like the text they filter */
+		struct freq_tokopts fopts = *opts;
+
+		fopts.stopwords = NULL;
+		freq_tokenize_file(opts->stopfile, &fopts, wordlist_add, &wl);
+	}
+
+	opts->stopwords = freq_stopwords_create((const char *const *)wl.words,
+			wl.n);
+
+	for (size_t i = 0; i < wl.n; i++)
+		free(wl.words[i]);
+	free(wl.words);
+}
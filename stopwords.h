@@ -0,0 +1,41 @@
+/*
+ * stopwords.h -- built-in stopword list and the hash used to look it up
+ *
+ * the list is a macro so C (stopwords.c) and constexpr C++
+ * (stopwords.hpp) build their perfect hash tables from the same words.
+ * All words are lower case, use -f to filter capitalized forms as well.
+ */
+#ifndef STOPWORDS_H
+#define STOPWORDS_H 1
+
+#define FREQ_BUILTIN_STOPWORDS \
+	"a", "about", "above", "after", "again", "against", "all", "am", \
+	"an", "and", "any", "are", "as", "at", "be", "because", "been", \
+	"before", "being", "below", "between", "both", "but", "by", "can", \
+	"could", "did", "do", "does", "doing", "down", "during", "each", \
+	"few", "for", "from", "further", "had", "has", "have", "having", \
+	"he", "her", "here", "hers", "herself", "him", "himself", "his", \
+	"how", "i", "if", "in", "into", "is", "it", "its", "itself", \
+	"just", "me", "more", "most", "my", "myself", "no", "nor", "not", \
+	"now", "of", "off", "on", "once", "only", "or", "other", "our", \
+	"ours", "ourselves", "out", "over", "own", "same", "she", "should", \
+	"so", "some", "such", "than", "that", "the", "their", "theirs", \
+	"them", "themselves", "then", "there", "these", "they", "this", \
+	"those", "through", "to", "too", "under", "until", "up", "very", \
+	"was", "we", "were", "what", "when", "where", "which", "while", \
+	"who", "whom", "why", "will", "with", "would", "you", "your", \
+	"yours", "yourself", "yourselves"
+
+/*
+ * perfect hash: a word's 64-bit hash picks a bucket, and the bucket's
+ * displacement d picks the word's slot, d is searched for at build time
+ * so that every word lands in a slot of its own
+ */
+#define FREQ_SW_FNV_BASIS	14695981039346656037ULL
+#define FREQ_SW_FNV_PRIME	1099511628211ULL
+#define FREQ_SW_GOLDEN		0x9e3779b97f4a7c15ULL
+
+/* buckets for n words, about four words per bucket */
+#define FREQ_SW_NBUCKETS(n)	((n) / 4 + 1)
+
+#endif
@@ -0,0 +1,161 @@
+/*
+ * stopwords.hpp -- compile-time perfect hash of the built-in stopwords
+ *
+ * the same minimal perfect hash stopwords.c builds at run time, searched
+ * for by the compiler instead: builtin_stopwords is a constant, and
+ * checking a word against it is a hash, a load and a compare.
+ */
+#ifndef STOPWORDS_HPP
+#define STOPWORDS_HPP 1
+
+#include <stdint.h>
+#include <string.h>
+
+#include <cstddef>
+
+#include "stopwords.h"
+
+namespace libfreq {
+
+/* 64-bit FNV-1a of the len bytes at s, same as sw_hash() in stopwords.c */
+constexpr uint64_t sw_hash(const char *s, size_t len)
+{
+	uint64_t h = FREQ_SW_FNV_BASIS;
+
+	for (size_t i = 0; i < len; i++) {
+		h ^= (unsigned char)s[i];
+		h *= FREQ_SW_FNV_PRIME;
+	}
+
+	return h;
+}
+
+/* slot of a word with hash h in a bucket with displacement d */
+constexpr size_t sw_slot(uint64_t h, uint32_t d, size_t n)
+{
+	uint64_t x = h ^ (d * FREQ_SW_GOLDEN);
+
+	/* splitmix64 finalizer */
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+
+	return x % n;
+}
+
+constexpr size_t cstrlen(const char *s)
+{
+	size_t n = 0;
+
+	while (s[n])
+		n++;
+
+	return n;
+}
+
+/* a set of N distinct words with one slot per word */
+template <size_t N>
+struct perfect_set {
+	static constexpr size_t NBUCKETS = FREQ_SW_NBUCKETS(N);
+
+	uint32_t disp[NBUCKETS];	/* displacement of each bucket */
+	const char *slots[N];		/* word in each slot */
+	size_t lens[N];			/* length of the word in each slot */
+
+	/* true if the len bytes at word are in the set */
+	constexpr bool contains(const char *word, size_t len) const
+	{
+		uint64_t h = sw_hash(word, len);
+		size_t s = sw_slot(h, disp[(h >> 32) % NBUCKETS], N);
+
+		if (lens[s] != len)
+			return false;
+		for (size_t i = 0; i < len; i++)
+			if (slots[s][i] != word[i])
+				return false;
+		return true;
+	}
+
+	bool contains(const char *word) const
+	{
+		return contains(word, strlen(word));
+	}
+};
+
+/*
+ * search for the displacements of a perfect_set, biggest buckets first
+ * while most slots are free; words must be distinct or the search never
+ * ends and compilation fails on the constexpr loop limit
+ */
+template <size_t N>
+constexpr perfect_set<N> make_perfect_set(const char *const (&words)[N])
+{
+	constexpr size_t NBUCKETS = perfect_set<N>::NBUCKETS;
+	perfect_set<N> ps{};
+	uint64_t h[N] = {};
+	size_t size[NBUCKETS] = {};
+	bool done[NBUCKETS] = {};
+	bool taken[N] = {};
+	size_t slot[N] = {};
+	size_t member[N] = {};
+
+	for (size_t i = 0; i < N; i++) {
+		h[i] = sw_hash(words[i], cstrlen(words[i]));
+		size[(h[i] >> 32) % NBUCKETS]++;
+	}
+
+	for (size_t o = 0; o < NBUCKETS; o++) {
+		/* next biggest bucket */
+		size_t b = NBUCKETS;
+
+		for (size_t c = 0; c < NBUCKETS; c++)
+			if (!done[c] && (b == NBUCKETS || size[c] > size[b]))
+				b = c;
+		done[b] = true;
+
+		size_t nm = 0;
+		for (size_t i = 0; i < N; i++)
+			if ((h[i] >> 32) % NBUCKETS == b)
+				member[nm++] = i;
+
+		for (uint32_t d = 0; nm != 0; d++) {
+			size_t k = 0;
+
+			for (; k < nm; k++) {
+				slot[k] = sw_slot(h[member[k]], d, N);
+				if (taken[slot[k]])
+					break;
+				taken[slot[k]] = true;
+			}
+
+			if (k == nm) {
+				ps.disp[b] = d;
+				break;
+			}
+
+			/* collision, release what this try took */
+			while (k-- > 0)
+				taken[slot[k]] = false;
+		}
+
+		for (size_t k = 0; k < nm; k++) {
+			ps.slots[slot[k]] = words[member[k]];
+			ps.lens[slot[k]] = cstrlen(words[member[k]]);
+		}
+	}
+
+	return ps;
+}
+
+constexpr const char *builtin_stopword_list[] = { FREQ_BUILTIN_STOPWORDS };
+
+constexpr auto builtin_stopwords = make_perfect_set(builtin_stopword_list);
+
+static_assert(builtin_stopwords.contains("the", 3), "bad stopword hash");
+static_assert(builtin_stopwords.contains("yourselves", 10),
+		"bad stopword hash");
+static_assert(!builtin_stopwords.contains("freq", 4), "bad stopword hash");
+
+} /* namespace libfreq */
+
+#endif
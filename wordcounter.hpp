@@ -0,0 +1,398 @@
+/*
+ * wordcounter.hpp -- header-only word counter with compile-time policies
+ *
+ * WordCounter<Hash, Storage, LockPolicy, CountType> is the C++ flavor of
+ * the libfreq tables.  Every choice a backend makes at run time through
+ * struct freq_ops is a template parameter here, so each combination is
+ * compiled into its own fully inlined counter:
+ *
+ *	Hash		ClassicHash (the libfreq hash), FnvHash
+ *	Storage		Chained<NBUCKETS>, OpenAddressing<NSLOTS>
+ *	LockPolicy	NoLock, StripedLock<NSTRIPES>, AtomicLock
+ *	CountType	any unsigned integer type
+ *
+ * for example, a table for many threads with 64-bit counts:
+ *
+ *	WordCounter<FnvHash, Chained<>, AtomicLock, uint64_t> wc;
+ *	wc.count("the");
+ */
+#ifndef WORDCOUNTER_HPP
+#define WORDCOUNTER_HPP 1
+
+#include <err.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <atomic>
+#include <cstddef>
+#include <limits>
+#include <mutex>
+#include <utility>
+
+#include "libfreq.h"
+
+namespace libfreq {
+
+/*
+ * hash policies -- callable as hash(word), return an unreduced hash,
+ * the storage policy maps it onto its own table size
+ */
+
+/* the original freq hash, identical to freq_hash() before the modulo */
+struct ClassicHash {
+	size_t operator()(const char *s) const
+	{
+		unsigned h = FREQ_NBUCKETS ^ ((unsigned)*s++ << 2);
+		unsigned len = 0;
+
+		while (*s) {
+			len++;
+			h ^= (((unsigned)*s) << (len % 3)) +
+			    ((unsigned)*(s - 1) << ((len % 3 + 7)));
+			s++;
+		}
+		h ^= len;
+
+		return h;
+	}
+};
+
+/* 64-bit FNV-1a, spreads better over power-of-two tables */
+struct FnvHash {
+	size_t operator()(const char *s) const
+	{
+		uint64_t h = 14695981039346656037ULL;
+
+		while (*s) {
+			h ^= (unsigned char)*s++;
+			h *= 1099511628211ULL;
+		}
+
+		return (size_t)h;
+	}
+};
+
+/*
+ * lock policies -- a table owns one LockPolicy object and wraps every
+ * access to bucket or slot i in a guard(locks, i).  cell<T> is how a
+ * count is stored, link<T> how a pointer other threads may publish to is
+ * stored, and load()/publish()/bump() are the only ways they are touched.
+ * bump() saturates, a count at its type's maximum stays there, as the C
+ * tables' freq_sat_add() does.
+ */
+
+/* no locking at all, for a table owned by one thread */
+struct NoLock {
+	template <class T> using cell = T;
+	template <class T> using link = T;
+
+	struct guard {
+		guard(NoLock &, size_t) {}
+	};
+
+	template <class T> static T load(const link<T> &l)
+	{
+		return l;
+	}
+
+	template <class T> static bool publish(link<T> &l, T, T desired)
+	{
+		l = desired;
+		return true;
+	}
+
+	template <class T> static void bump(cell<T> &c)
+	{
+		if (c != std::numeric_limits<T>::max())
+			c++;
+	}
+
+	template <class T> static T get(const cell<T> &c)
+	{
+		return c;
+	}
+};
+
+/* NSTRIPES mutexes, bucket or slot i is protected by stripe i % NSTRIPES */
+template <size_t NSTRIPES = 64>
+struct StripedLock {
+	template <class T> using cell = T;
+	template <class T> using link = T;
+
+	/*
+	 * pad each stripe to a cache line so stripes don't share lines,
+	 * padded rather than alignas(64) so tables can still be new'd
+	 * before C++17
+	 */
+	struct stripe {
+		std::mutex mutex;
+		char pad[64 - sizeof(std::mutex) % 64];
+	} stripes[NSTRIPES];
+
+	struct guard {
+		std::lock_guard<std::mutex> lock;
+
+		guard(StripedLock &l, size_t i) :
+			lock(l.stripes[i % NSTRIPES].mutex) {}
+	};
+
+	template <class T> static T load(const link<T> &l)
+	{
+		return l;
+	}
+
+	template <class T> static bool publish(link<T> &l, T, T desired)
+	{
+		l = desired;
+		return true;
+	}
+
+	template <class T> static void bump(cell<T> &c)
+	{
+		if (c != std::numeric_limits<T>::max())
+			c++;
+	}
+
+	template <class T> static T get(const cell<T> &c)
+	{
+		return c;
+	}
+};
+
+/* lock-free: counts and new words are both published with CAS */
+struct AtomicLock {
+	template <class T> using cell = std::atomic<T>;
+	template <class T> using link = std::atomic<T>;
+
+	struct guard {
+		guard(AtomicLock &, size_t) {}
+	};
+
+	template <class T> static T load(const link<T> &l)
+	{
+		return l.load(std::memory_order_acquire);
+	}
+
+	template <class T> static bool publish(link<T> &l, T expected,
+			T desired)
+	{
+		return l.compare_exchange_strong(expected, desired,
+				std::memory_order_acq_rel);
+	}
+
+	template <class T> static void bump(cell<T> &c)
+	{
+		T v = c.load(std::memory_order_relaxed);
+
+		while (v != std::numeric_limits<T>::max() &&
+		    !c.compare_exchange_weak(v, v + 1,
+				std::memory_order_relaxed))
+			;
+	}
+
+	template <class T> static T get(const cell<T> &c)
+	{
+		return c.load(std::memory_order_relaxed);
+	}
+};
+
+/* copy a word into memory owned by a table */
+inline char *copy_word(const char *word)
+{
+	char *s;
+
+	if ((s = strdup(word)) == NULL)
+		err(1, "strdup");
+
+	return s;
+}
+
+/*
+ * storage policies -- Storage::table<LockPolicy, CountType> is the table
+ * itself and provides count(word, hash) and walk(fn)
+ */
+
+/* NBUCKETS linked lists of entries, the layout the C backends use */
+template <size_t NBUCKETS = FREQ_NBUCKETS>
+struct Chained {
+	template <class L, class C>
+	class table {
+		/* entries in a bucket are a linked list of struct entry */
+		struct entry {
+			entry *next;		/* immutable once published */
+			const char *word;
+			typename L::template cell<C> count;
+
+			entry(const char *w, entry *n) :
+				next(n), word(copy_word(w)), count(1) {}
+			~entry()
+			{
+				free((char *)word);
+			}
+		};
+
+		typename L::template link<entry *> buckets[NBUCKETS];
+		L locks;
+
+	public:
+		table() : buckets() {}
+
+		~table()
+		{
+			for (size_t i = 0; i < NBUCKETS; i++) {
+				entry *ep = L::load(buckets[i]);
+
+				while (ep != NULL) {
+					entry *next = ep->next;
+					delete ep;
+					ep = next;
+				}
+			}
+		}
+
+		/* bump the count for a word */
+		void count(const char *word, size_t hash)
+		{
+			size_t b = hash % NBUCKETS;
+			typename L::guard g(locks, b);
+
+			for (;;) {
+				entry *head = L::load(buckets[b]);
+
+				for (entry *ep = head; ep != NULL;
+						ep = ep->next)
+					if (strcmp(word, ep->word) == 0) {
+						/* already in table */
+						L::bump(ep->count);
+						return;
+					}
+
+				/* add it to the front of the linked list */
+				entry *ep = new entry(word, head);
+
+				if (L::publish(buckets[b], head, ep))
+					return;
+
+				/* lost a race with another insert, rescan */
+				ep->next = NULL;
+				delete ep;
+			}
+		}
+
+		/* call fn(word, count) for every entry */
+		template <class F> void walk(F fn)
+		{
+			for (size_t i = 0; i < NBUCKETS; i++)
+				for (entry *ep = L::load(buckets[i]);
+						ep != NULL; ep = ep->next)
+					fn(ep->word, L::get(ep->count));
+		}
+	};
+};
+
+/*
+ * NSLOTS slots probed linearly, no chains to walk; NSLOTS must be a
+ * power of two and the table does not grow, so size it for the vocabulary
+ */
+template <size_t NSLOTS = (1 << 20)>
+struct OpenAddressing {
+	static_assert((NSLOTS & (NSLOTS - 1)) == 0,
+			"NSLOTS must be a power of two");
+
+	template <class L, class C>
+	class table {
+		struct slot {
+			typename L::template link<const char *> word;
+			typename L::template cell<C> count;
+		};
+
+		slot *slots;
+		L locks;
+
+	public:
+		table() : slots(new slot[NSLOTS]()) {}
+
+		~table()
+		{
+			for (size_t i = 0; i < NSLOTS; i++)
+				free((char *)L::load(slots[i].word));
+			delete[] slots;
+		}
+
+		/* bump the count for a word */
+		void count(const char *word, size_t hash)
+		{
+			size_t i = hash & (NSLOTS - 1);
+
+			for (size_t n = 0; n < NSLOTS;) {
+				typename L::guard g(locks, i);
+				const char *w = L::load(slots[i].word);
+
+				if (w == NULL) {
+					/* empty slot, try to claim it */
+					char *s = copy_word(word);
+
+					if (!L::publish(slots[i].word, w,
+							(const char *)s)) {
+						/* lost it, look again */
+						free(s);
+						continue;
+					}
+					w = s;
+				}
+
+				if (strcmp(word, w) == 0) {
+					L::bump(slots[i].count);
+					return;
+				}
+
+				i = (i + 1) & (NSLOTS - 1);
+				n++;
+			}
+
+			errx(1, "word table full (%zu slots)", NSLOTS);
+		}
+
+		/* call fn(word, count) for every entry */
+		template <class F> void walk(F fn)
+		{
+			for (size_t i = 0; i < NSLOTS; i++) {
+				const char *w = L::load(slots[i].word);
+
+				if (w != NULL)
+					fn(w, L::get(slots[i].count));
+			}
+		}
+	};
+};
+
+template <class Hash = ClassicHash, class Storage = Chained<>,
+	class LockPolicy = NoLock, class CountType = unsigned long>
+class WordCounter {
+	typename Storage::template table<LockPolicy, CountType> t;
+	Hash hash;
+
+public:
+	typedef CountType count_type;
+
+	/* arguments, if any, go to the storage policy's table */
+	template <class... Args>
+	explicit WordCounter(Args &&... args) :
+		t(std::forward<Args>(args)...) {}
+
+	/* bump the count for a word */
+	void count(const char *word)
+	{
+		t.count(word, hash(word));
+	}
+
+	/* call fn(const char *word, CountType count) for every entry */
+	template <class F> void walk(F fn)
+	{
+		t.walk(fn);
+	}
+};
+
+} /* namespace libfreq */
+
+#endif